@@ -0,0 +1,78 @@
+// Instrumented graph kernels used to check that a HOOKS_DISABLED build costs nothing
+//
+// The hooks_disabled_check target compiles this file twice: once with the hook calls and
+// -DHOOKS_DISABLED, and once with the calls removed by the preprocessor (-DHOOKS_STRIPPED).
+// The build fails if the generated code differs.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(HOOKS_STRIPPED)
+#define HOOK(call)
+#else
+#include "hooks.h"
+#include "hooks_c.h"
+#define HOOK(call) call
+#endif
+
+// Breadth-first search over a graph in CSR format, returns the number of vertices reached
+long
+bfs(const std::vector<int64_t>& offsets, const std::vector<int64_t>& neighbors, int64_t source, std::vector<int64_t>& depth)
+{
+    HOOK(Hooks& hooks = Hooks::getInstance());
+    HOOK(Hooks::counter_id visited = hooks.register_counter("vertices_visited"));
+    HOOK(hooks.set_attr("source", source));
+    HOOK(hooks.region_begin("bfs"));
+    std::vector<int64_t> frontier(1, source), next;
+    depth.assign(offsets.size() - 1, -1);
+    depth[source] = 0;
+    long reached = 1;
+    for (int64_t level = 1; !frontier.empty(); ++level) {
+        HOOK(Hooks::scoped_region level_region(hooks.register_region("bfs_level")));
+        HOOK(hooks.thread_work_begin());
+        for (int64_t v : frontier) {
+            int64_t begin = offsets[v], end = offsets[v + 1];
+            HOOK(hooks.add_counter(visited, 1));
+            HOOK(hooks.traverse_edges(end - begin));
+            for (int64_t e = begin; e < end; ++e) {
+                int64_t u = neighbors[e];
+                if (depth[u] == -1) {
+                    depth[u] = level;
+                    next.push_back(u);
+                    reached += 1;
+                }
+            }
+        }
+        HOOK(hooks.thread_work_end());
+        frontier.swap(next);
+        next.clear();
+    }
+    HOOK(hooks.set_stat("reached", (int64_t)reached));
+    HOOK(hooks.region_end());
+    return reached;
+}
+
+// Same kind of loop through the C interface
+extern "C" double
+pagerank_step(const int64_t* offsets, const int64_t* neighbors, int64_t n, const double* rank, double* next_rank)
+{
+    HOOK(hooks_latency_id vertex_latency = hooks_register_latency("vertex"));
+    HOOK(hooks_region_begin("pagerank_step"));
+    double delta = 0;
+    for (int64_t v = 0; v < n; ++v) {
+        HOOK(uint64_t start = hooks_op_begin());
+        int64_t begin = offsets[v], end = offsets[v + 1];
+        double sum = 0;
+        for (int64_t e = begin; e < end; ++e) {
+            sum += rank[neighbors[e]];
+        }
+        HOOK(hooks_traverse_edges_inline(end - begin));
+        next_rank[v] = 0.15 / n + 0.85 * sum;
+        delta += next_rank[v] > rank[v] ? next_rank[v] - rank[v] : rank[v] - next_rank[v];
+        HOOK(hooks_op_end(vertex_latency, start));
+    }
+    HOOK(hooks_set_attr_f64("delta", delta));
+    HOOK(hooks_region_end());
+    return delta;
+}
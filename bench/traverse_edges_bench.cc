@@ -0,0 +1,39 @@
+// Measures the throughput of Hooks::traverse_edges from 1 up to OMP_NUM_THREADS threads
+//
+// Usage: traverse_edges_bench [calls_per_thread]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <omp.h>
+#include "hooks.h"
+
+int main(int argc, char* argv[])
+{
+    long calls = argc > 1 ? atol(argv[1]) : 100 * 1000 * 1000;
+    // Keep region records out of the benchmark output
+    setenv("HOOKS_FILENAME", "/dev/null", 0);
+    Hooks& hooks = Hooks::getInstance();
+
+    printf("threads,calls_per_sec,calls_per_sec_per_thread\n");
+    int max_threads = omp_get_max_threads();
+    for (int num_threads = 1; num_threads <= max_threads; num_threads = num_threads < max_threads
+                                                                     ? std::min(num_threads * 2, max_threads)
+                                                                     : max_threads + 1) {
+        hooks.region_begin("traverse_edges_bench");
+        auto t1 = std::chrono::steady_clock::now();
+        #pragma omp parallel num_threads(num_threads)
+        {
+            for (long i = 0; i < calls; ++i) {
+                hooks.traverse_edges(1);
+            }
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        hooks.region_end();
+        double seconds = std::chrono::duration<double>(t2 - t1).count();
+        double rate = calls * num_threads / seconds;
+        printf("%d,%.4g,%.4g\n", num_threads, rate, rate / num_threads);
+    }
+    return 0;
+}
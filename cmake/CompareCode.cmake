@@ -0,0 +1,24 @@
+# Fail if two object files contain different machine code
+#
+# Usage:
+#
+#     cmake -DOBJDUMP=<objdump> -DFIRST=<object> -DSECOND=<object> -P CompareCode.cmake
+#
+# Both objects are disassembled, and the disassembly is compared with the file
+# names removed. On a mismatch, the disassembly is left next to each object.
+
+foreach(object FIRST SECOND)
+	execute_process(COMMAND ${OBJDUMP} -d --no-show-raw-insn ${${object}}
+		OUTPUT_VARIABLE ${object}_CODE
+		RESULT_VARIABLE result)
+	if (NOT result EQUAL 0)
+		message(FATAL_ERROR "Cannot disassemble ${${object}}")
+	endif()
+	string(REPLACE "${${object}}" "" ${object}_CODE "${${object}_CODE}")
+endforeach()
+
+if (NOT FIRST_CODE STREQUAL SECOND_CODE)
+	file(WRITE "${FIRST}.s" "${FIRST_CODE}")
+	file(WRITE "${SECOND}.s" "${SECOND_CODE}")
+	message(FATAL_ERROR "Generated code differs, compare ${FIRST}.s and ${SECOND}.s")
+endif()
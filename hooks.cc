@@ -1,10 +1,34 @@
+#if defined(HOOKS_DISABLED)
+#error "hooks.cc is not built with HOOKS_DISABLED, the headers define every hook as an empty inline function"
+#endif
+
 #include "hooks.h"
+#include "hooks_c.h"
 #include <chrono>
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <new>
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
 #include <valarray>
 #include <iostream>
 #include <fstream>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include "json.hpp"
+#include "hooks_timer.h"
+#include "hooks_writer.h"
+#include "hooks_stats.h"
+#include "hooks_values.h"
+#include "hooks_backends.h"
 
 #if defined(_OPENMP)
 #include <omp.h>
@@ -12,16 +36,7 @@
 
 #if defined(USE_MPI)
 #include <mpi.h>
-#endif
-
-#if defined(ENABLE_SNIPER_HOOKS)
-#include <hooks_base.h>
-#elif defined(ENABLE_GEM5_HOOKS)
-#include <util/m5/m5op.h>
-#elif defined(ENABLE_PIN_HOOKS)
-// Nothing to include here
-#elif defined(ENABLE_PERF_HOOKS)
-#include <perf.h>
+#include <numeric>
 #endif
 
 using json = nlohmann::json;
@@ -32,35 +47,366 @@ using std::vector;
 class Hooks::impl
 {
     friend class Hooks;
-    // Stream for writing out json results
-    std::ofstream out;
-    // Name of the region we are currently in, or "" outside of a region
-    string region_name;
-    // Start and end times of the last region
-    std::chrono::time_point<std::chrono::steady_clock> t1, t2;
-    // Number of edges traversed during the current region (per thread)
-    vector<int64_t> num_traversed_edges;
-    // Dict of custom attributes that should be printed after every region_end
-    json attrs;
-    // Dict of custom results that should be printed after the next region_end
-    json stats;
-#if defined(ENABLE_PERF_HOOKS)
-    // Names of perf events to collect this run
-    vector<string> perf_event_names;
-    // Number of perf events to collect each trial
-    int perf_group_size;
-    gBenchPerf_event perf_events;
-    gBenchPerf_multi perf;
-    int trial;
-#endif
+    // Entries added by ID while other threads read them without locking (names of regions, counters, ...)
+    // Entries live in chunks that never move, and the count is only published once a new entry is in place
+    template<typename T, size_t chunk_size, size_t max_chunks>
+    class registry_table
+    {
+    public:
+        registry_table() : _size(0) { std::fill(_chunks, _chunks + max_chunks, nullptr); }
+        ~registry_table() { for (T* chunk : _chunks) { delete[] chunk; } }
+        size_t size() const { return _size.load(std::memory_order_acquire); }
+        bool full() const { return size() == chunk_size * max_chunks; }
+        const T& operator[](size_t i) const { return _chunks[i / chunk_size][i % chunk_size]; }
+        // Only one thread may add entries at a time, returns the ID of the new entry
+        size_t push_back(const T& entry)
+        {
+            size_t i = _size.load(std::memory_order_relaxed);
+            T*& chunk = _chunks[i / chunk_size];
+            if (!chunk) { chunk = new T[chunk_size]; }
+            chunk[i % chunk_size] = entry;
+            _size.store(i + 1, std::memory_order_release);
+            return i;
+        }
+    protected:
+        T* _chunks[max_chunks];
+        std::atomic<size_t> _size;
+    };
+    // Keys of attrs and stats, declared before the writer so they outlive the records it has queued
+    hooks_key_table keys;
+    // Work counters have a fixed number of slots per thread, so an increment is a single add
+    static const int max_counters = 32;
+    // Latency histograms also have a fixed number of slots per thread
+    static const int max_latencies = 64;
+    // Names of counters registered with register_counter, indexed by counter_id
+    // Also used as output keys, so they are declared before the writer too
+    registry_table<string, max_counters, 1> counter_names;
+    std::unordered_map<string, counter_id> counter_ids;
+    // Output keys of each counter, built when it is registered so region_end does not concatenate strings
+    struct counter_keys
+    {
+        string total, rate, rate_per_thread;
+    };
+    registry_table<counter_keys, max_counters, 1> counter_output_keys;
+    // Names of operations registered with register_latency, indexed by latency_id
+    registry_table<string, max_latencies, 1> latency_names;
+    std::unordered_map<string, latency_id> latency_ids;
+    // Output key of each latency, name + "_latency_ns"
+    registry_table<string, max_latencies, 1> latency_output_keys;
+    // Writes json results to the output file in the background
+    hooks_writer out;
+    // Clock used to time regions
+    hooks_timer timer;
+    // Simulator markers, perf counters, tracepoints, ... enabled at compile time
+    hooks_backends backends;
+    // Names of the counters reported by the backends, set when the outermost region begins
+    vector<string> backend_counter_names;
+    // Kernel ID of each registered thread, updated when the outermost region begins
+    vector<pid_t> thread_kernel_tids;
+    // State of a region that has begun but not yet ended
+    struct region_frame
+    {
+        // Registered ID of the region
+        region_id id;
+        // Start time of the region
+        hooks_timer::ticks t1;
+        // Counter values when the region began [thread * max_counters + counter_id]
+        vector<int64_t> counts_begin;
+        // Inclusive totals of completed child regions, subtracted to get exclusive values
+        double child_time_ms;
+        vector<int64_t> child_counts;
+        // Thread activity of the enclosing region, restored when this region ends (per thread)
+        vector<hooks_timer::ticks> parent_work_first, parent_work_last;
+        // Backend counter values when the region began, and totals of completed child regions [counter][thread]
+        vector<vector<uint64_t>> backend_begin;
+        vector<vector<uint64_t>> backend_child;
+        // Latencies recorded during the region so far (per latency_id), including completed child regions
+        // Threads record into their slots, which are folded in here whenever a child region begins
+        vector<hdr_histogram> latencies;
+        // Records of completed child regions
+        vector<hooks_record> children;
+    };
+    // Stack of open regions, innermost region last
+    // Frames above the current depth are kept around and reused, so beginning a region does not allocate
+    vector<region_frame> regions;
+    size_t depth;
+    // Names of all registered regions, indexed by region_id
+    registry_table<string, 64, 1024> region_names;
+    // Lookup table for region_begin(name)
+    std::unordered_map<string, region_id> region_ids;
+    static const hooks_timer::ticks no_work = ~(hooks_timer::ticks)0;
+    // Values updated by a single thread, from inside the application's loops
+    // Each slot gets its own cache line(s), so counting on one thread does not invalidate the others
+    struct alignas(64) thread_slot
+    {
+        // Value of each work counter since the program began (per counter_id)
+        int64_t counts[max_counters];
+        // First call to thread_work_begin and last call to thread_work_end in the current region
+        hooks_timer::ticks work_first, work_last;
+        // Operation latencies in nanoseconds recorded during the current region (per latency_id)
+        // Fixed size, so that recording never moves histograms that region_end may be reading
+        hdr_histogram latencies[max_latencies];
+        // Kernel ID of the thread, so backends can attach to it from other threads
+        std::atomic<pid_t> kernel_tid;
+        // Set when the thread exits, until another thread takes over the slot
+        std::atomic<bool> exited;
+
+        thread_slot() : work_first(no_work), work_last(0), kernel_tid(syscall(SYS_gettid)), exited(false) { std::fill(counts, counts + max_counters, 0); }
+    };
+    // Registry of every thread that has used the hooks, giving each a dense ID and a slot
+    // Slots are allocated by the thread that uses them, so they are placed in that thread's NUMA node
+    // The table is split into chunks that never move once allocated, so it can grow while other threads read it
+    static const int slots_per_chunk = 64;
+    static const int max_slot_chunks = 1024;
+    struct slot_chunk
+    {
+        std::atomic<thread_slot*> slots[slots_per_chunk];
+        slot_chunk() { for (auto& slot : slots) { slot.store(nullptr); } }
+    };
+    std::atomic<slot_chunk*> slot_chunks[max_slot_chunks];
+    // IDs below this are kept for the OpenMP team, so they match OpenMP thread numbers
+    // Each team thread claims the ID of its OpenMP thread number the first time it uses the hooks
+    int num_team_ids;
+    // Number of thread IDs handed out so far
+    std::atomic<int> num_thread_ids;
+    // IDs above the team's whose threads have exited, handed out again before new ones
+    vector<int> free_thread_ids;
+    std::mutex free_thread_ids_mutex;
+    // Slot of the calling thread, or nullptr if it has not used the hooks yet
+    static thread_local thread_slot* current_slot;
+    // Gives the ID of the calling thread back when the thread exits
+    struct thread_exit_guard
+    {
+        impl* owner;
+        int tid;
+        thread_exit_guard() : owner(nullptr), tid(-1) {}
+        ~thread_exit_guard() { if (owner) { owner->release_thread(tid); } }
+    };
+    static thread_local thread_exit_guard exit_guard;
+    // Held while registering regions, counters and latencies, which may happen on any thread
+    // Readers of the name tables do not need it, see registry_table
+    std::mutex registration_mutex;
+    // Output keys of the fields every region reports
+    hooks_key_table::key region_name_key, time_ms_key, time_cycles_key;
+    hooks_key_table::key thread_busy_ms_key, thread_idle_ms_key, imbalance_key;
+    // Buffers used by region_end, kept between calls so that ending a region does not allocate
+    struct end_buffers
+    {
+        // Work done by each thread [counter_id * num_threads + thread]
+        vector<int64_t> counts, exclusive_counts;
+        vector<int64_t> total_counts;
+        // Per-thread values of a single field
+        vector<double> thread_rates, busy_ms, idle_ms;
+    } scratch;
+    // Custom attributes that should be printed after every region_end
+    hooks_value_set attrs;
+    // Copy of attrs shared by the records written since the last set_attr, made on first use
+    std::shared_ptr<const hooks_value_set> attrs_snapshot;
+    // Custom results that should be printed after the next region_end
+    hooks_value_set stats;
+    // Summary of every instance of a region that ran with the same attributes
+    struct region_summary
+    {
+        region_id id;
+        std::shared_ptr<const hooks_value_set> attrs;
+        running_stats time_ms;
+        log2_histogram time_ns_histogram;
+        // Totals of each work counter (per counter_id)
+        vector<distribution> counts;
+        // Perf counters (summed over threads) and numeric stats, by name
+        std::map<string, distribution> values;
+        // Operation latencies, by latency_id
+        vector<hdr_histogram> latencies;
+    };
+    // If set, regions are summarized in memory rather than written out one record at a time
+    bool aggregate;
+    // Summaries are written out at this interval, and at exit
+    double aggregate_interval_ms;
+    hooks_timer::ticks last_summary_time;
+    // Summaries keyed by region and attribute set
+    std::map<std::pair<region_id, size_t>, region_summary> summaries;
+    // Each distinct set of attrs gets an index, so regions can be keyed by attribute set without comparing values
+    std::unordered_map<string, size_t> attrs_indices;
+    size_t attrs_index;
+    // Interval at which a background thread samples counters while a region is open, 0 to disable
+    double sample_interval_ms;
+    std::thread sampler;
+    // Protects the sampling state below, which is shared with the sampler thread
+    std::mutex sample_mutex;
+    std::condition_variable sample_cv;
+    bool sampler_done;
+    // Set while the outermost region is open
+    bool sample_active;
+    hooks_timer::ticks sample_t1;
+    // num_traversed_edges of each thread when sampling began
+    vector<int64_t> sample_edges_begin;
+    // Series sampled so far in the current region
+    json samples;
 
 #if defined(_OPENMP)
-    static int get_num_threads() { return omp_get_max_threads(); }
-    static int get_thread_id() { return omp_get_thread_num(); }
+    static int get_max_omp_threads() { return omp_get_max_threads(); }
+    static int get_omp_thread_num() { return omp_get_thread_num(); }
+    // Thread number of the calling thread in the outermost OpenMP team, or -1 if it is not part of one
+    // The initial thread is thread 0 of every outermost team, so it counts as 0 outside of parallel regions too
+    static int get_team_thread_num()
+    {
+        if (omp_get_level() > 0) { return omp_get_ancestor_thread_num(1); }
+        return syscall(SYS_gettid) == getpid() ? 0 : -1;
+    }
+#else
+    static int get_max_omp_threads() { return 1; }
+    static int get_omp_thread_num() { return 0; }
+    static int get_team_thread_num() { return -1; }
+#endif
+
+    // Number of threads that have been given an ID, some of which may not have registered yet
+    int get_num_threads() const { return num_thread_ids.load(std::memory_order_acquire); }
+
+    // Slot of the calling thread, which is given the next free ID on first use
+    thread_slot& get_current_slot()
+    {
+        if (!current_slot) {
+            int tid = get_team_thread_num();
+            // Nested teams share the outermost thread numbers, only the first thread to claim one gets it
+            if (tid < 0 || tid >= num_team_ids || !register_thread(tid)) {
+                register_thread(get_free_thread_id());
+            }
+        }
+        return *current_slot;
+    }
+
+    // ID of a thread that has exited, or a new one
+    int get_free_thread_id()
+    {
+        std::lock_guard<std::mutex> lock(free_thread_ids_mutex);
+        if (free_thread_ids.empty()) { return num_thread_ids.fetch_add(1); }
+        int tid = free_thread_ids.back();
+        free_thread_ids.pop_back();
+        return tid;
+    }
+
+    // Slot for a thread ID, or nullptr if that thread has not finished registering
+    thread_slot* get_slot(int tid) const
+    {
+        slot_chunk* chunk = slot_chunks[tid / slots_per_chunk].load(std::memory_order_acquire);
+        return chunk ? chunk->slots[tid % slots_per_chunk].load(std::memory_order_acquire) : nullptr;
+    }
+
+    // Give the calling thread a slot under ID tid, returns false if another thread already has that ID
+    // The slot of an exited thread is taken over as it is, so its counts keep adding up in open regions
+    bool register_thread(int tid)
+    {
+        if (tid >= max_slot_chunks * slots_per_chunk) {
+            cerr << "ERROR: too many threads registered with hooks\n";
+            exit(-1);
+        }
+        std::atomic<slot_chunk*>& chunk_ptr = slot_chunks[tid / slots_per_chunk];
+        slot_chunk* chunk = chunk_ptr.load(std::memory_order_acquire);
+        if (!chunk) {
+            // Another thread may be adding the same chunk, whoever gets there first wins
+            slot_chunk* new_chunk = new slot_chunk();
+            if (chunk_ptr.compare_exchange_strong(chunk, new_chunk)) {
+                chunk = new_chunk;
+            } else {
+                delete new_chunk;
+            }
+        }
+        std::atomic<thread_slot*>& entry = chunk->slots[tid % slots_per_chunk];
+        thread_slot* slot = entry.load(std::memory_order_acquire);
+        if (slot) {
+            bool exited = true;
+            if (!slot->exited.compare_exchange_strong(exited, false, std::memory_order_acq_rel)) { return false; }
+            slot->kernel_tid = syscall(SYS_gettid);
+        } else {
+            slot = new_thread_slot();
+            thread_slot* expected = nullptr;
+            if (!entry.compare_exchange_strong(expected, slot, std::memory_order_acq_rel)) {
+                slot->~thread_slot();
+                free(slot);
+                return false;
+            }
+        }
+        current_slot = slot;
+        hooks_thread_counts = slot->counts;
+        exit_guard.owner = this;
+        exit_guard.tid = tid;
+        return true;
+    }
+
+    // Called as the thread that has ID tid exits, so that a later thread can take over its slot
+    void release_thread(int tid)
+    {
+        current_slot = nullptr;
+        hooks_thread_counts = nullptr;
+        get_slot(tid)->exited.store(true, std::memory_order_release);
+        // Team IDs are only taken over by the team thread with the same number
+        if (tid >= num_team_ids) {
+            std::lock_guard<std::mutex> lock(free_thread_ids_mutex);
+            free_thread_ids.push_back(tid);
+        }
+    }
+
+    static int
+    get_output_indent()
+    {
+#if defined(HOOKS_PRETTY_PRINT)
+        return 2;
 #else
-    static int get_num_threads() { return 1; }
-    static int get_thread_id() { return 0; }
+        return 0;
 #endif
+    }
+
+    static hooks_writer::output_format
+    get_output_format()
+    {
+        if (const char* format = getenv("HOOKS_FORMAT"))
+        {
+            if (string(format) == "msgpack") { return hooks_writer::MSGPACK; }
+            if (string(format) != "json") {
+                cerr << "WARNING: Unknown HOOKS_FORMAT " << format << ", defaulting to json.\n";
+            }
+        }
+        return hooks_writer::JSON;
+    }
+
+    // Size of the crash-safe ring buffer file, or 0 to write a regular file
+    static uint64_t
+    get_ring_size()
+    {
+        if (const char* env_size = getenv("HOOKS_RING_SIZE"))
+        {
+            char* suffix;
+            uint64_t size = strtoull(env_size, &suffix, 10);
+            switch (*suffix) {
+                case 'G': case 'g': size <<= 10; // fall through
+                case 'M': case 'm': size <<= 10; // fall through
+                case 'K': case 'k': size <<= 10;
+            }
+            return size;
+        }
+        return 0;
+    }
+
+    static bool
+    get_aggregate()
+    {
+        const char* env_aggregate = getenv("HOOKS_AGGREGATE");
+        return env_aggregate && atoi(env_aggregate) != 0;
+    }
+
+    static double
+    get_aggregate_interval_ms()
+    {
+        const char* env_interval = getenv("HOOKS_AGGREGATE_INTERVAL_MS");
+        return env_interval ? atof(env_interval) : 0;
+    }
+
+    static double
+    get_sample_interval_ms()
+    {
+        const char* env_interval = getenv("HOOKS_SAMPLE_INTERVAL_MS");
+        return env_interval ? atof(env_interval) : 0;
+    }
 
     static string
     get_output_filename()
@@ -74,161 +420,532 @@ class Hooks::impl
         }
     }
 
-#if defined(ENABLE_PERF_HOOKS)
-
-    static vector<string>
-    get_perf_event_names()
+    impl()
+     : out(get_output_filename(), get_output_format(), get_output_indent(), get_ring_size())
+     , depth(0)
+     , num_team_ids(get_max_omp_threads())
+     , num_thread_ids(num_team_ids)
+     , aggregate(get_aggregate())
+     , aggregate_interval_ms(get_aggregate_interval_ms())
+     , attrs_index(0)
+     , sample_interval_ms(get_sample_interval_ms())
+     , sampler_done(false)
+     , sample_active(false)
+     , sample_t1(0)
     {
-        vector<string> event_names = {"", "--perf-event"};
-        if (const char* env_names = getenv("PERF_EVENT_NAMES"))
-        {
-            char * names = new char[strlen(env_names) + 1];
-            strcpy(names, env_names);
-            char * p = strtok(names, " ");
-            while (p)
+        for (auto& chunk : slot_chunks) { chunk.store(nullptr); }
+        // Register the OpenMP team up front, so that thread IDs match OpenMP thread numbers
+        // Any other thread (std::thread, pthreads, nested teams) gets the next free ID on first use
+#if defined(_OPENMP)
+        if (omp_in_parallel()) {
+            // A team started here would be nested, and may only have the calling thread in it
+            // Instead, each team thread registers the first time it uses the hooks
+            get_current_slot();
+        } else {
+            #pragma omp parallel num_threads(get_max_omp_threads())
             {
-                event_names.push_back(string(p));
-                p = strtok(NULL, " ");
+                register_thread(get_omp_thread_num());
+            }
+        }
+#else
+        register_thread(0);
+#endif
+        register_counter("num_traversed_edges");
+        region_name_key = keys.intern("region_name");
+        time_ms_key = keys.intern("time_ms");
+        time_cycles_key = keys.intern("time_cycles");
+        thread_busy_ms_key = keys.intern("thread_busy_ms");
+        thread_idle_ms_key = keys.intern("thread_idle_ms");
+        imbalance_key = keys.intern("imbalance");
+        last_summary_time = timer.now();
+        attrs_indices[attrs.signature()] = attrs_index;
+        if (sample_interval_ms > 0) {
+            if (aggregate) {
+                cerr << "WARNING: HOOKS_SAMPLE_INTERVAL_MS is ignored when aggregating regions\n";
+            } else {
+                sampler = std::thread(&impl::sample_loop, this);
             }
-            delete[] names;
-
-        } else {
-            cerr << "WARNING: No perf events found in environment; set PERF_EVENT_NAMES.\n";
         }
-        return event_names;
     }
 
-    static int
-    get_perf_group_size()
+    ~impl()
     {
-        if (const char* env_group_size = getenv("PERF_GROUP_SIZE"))
-        {
-            return atoi(env_group_size);
-        } else {
-            cerr << "WARNING: Perf group size unspecified, defaulting to 4\n";
-            return 4;
+        if (sampler.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(sample_mutex);
+                sampler_done = true;
+            }
+            sample_cv.notify_one();
+            sampler.join();
+        }
+        // Write out whatever has been aggregated since the last interval
+        if (aggregate) { write_summaries(); }
+        for (int tid = 0; tid < get_num_threads(); ++tid) {
+            if (thread_slot* slot = get_slot(tid)) {
+                slot->~thread_slot();
+                free(slot);
+            }
         }
+        for (auto& chunk : slot_chunks) { delete chunk.load(); }
     }
 
-#endif
-
-    impl()
-     : out(get_output_filename(), std::ofstream::app)
-     , region_name("")
-     , num_traversed_edges(get_num_threads())
-#if defined(ENABLE_PERF_HOOKS)
-     , perf_event_names(get_perf_event_names())
-     , perf_group_size(get_perf_group_size())
-     , perf_events(perf_event_names, false)
-     , perf(get_num_threads(), perf_events)
-#endif
+    static thread_slot*
+    new_thread_slot()
     {
+        void* p;
+        if (posix_memalign(&p, alignof(thread_slot), sizeof(thread_slot)) != 0) {
+            cerr << "ERROR: failed to allocate thread slot\n";
+            exit(-1);
+        }
+        return new (p) thread_slot();
+    }
 
+    region_id
+    register_region(const string& name)
+    {
+        if (name == "") {
+            cerr << "ERROR: region name cannot be empty\n";
+            exit(-1);
+        }
+        std::lock_guard<std::mutex> lock(registration_mutex);
+        auto it = region_ids.find(name);
+        if (it != region_ids.end()) {
+            return it->second;
+        }
+        if (region_names.full()) {
+            cerr << "ERROR: cannot register region " << name << ", too many regions\n";
+            exit(-1);
+        }
+        region_id id = region_names.push_back(name);
+        region_ids[name] = id;
+        return id;
     }
 
     void __attribute__ ((noinline))
-    region_begin(string name)
+    region_begin(region_id id)
     {
-        // Check for mismatched begin/end pairs
-        if (region_name != "") {
-            cerr << "ERROR: called region_begin inside region\n";
+        if (id >= region_names.size()) {
+            cerr << "ERROR: region_begin called with unregistered region id " << id << "\n";
             exit(-1);
-        } else if (name == "") {
-            cerr << "ERROR: region name cannot be empty\n";
-            exit(-1);
-        } else {
-            region_name = name;
         }
+        // Regions may be nested, the new region becomes a child of the current one
+        if (depth == regions.size()) {
+            regions.push_back(region_frame());
+        }
+        region_frame& region = regions[depth++];
+        region.id = id;
+        region.counts_begin.resize(get_num_threads() * max_counters);
+        region.child_time_ms = 0;
+        region.child_counts.assign(get_num_threads() * max_counters, 0);
+        region.parent_work_first.resize(get_num_threads());
+        region.parent_work_last.resize(get_num_threads());
+        for (int tid = 0; tid < get_num_threads(); ++tid) {
+            thread_slot* slot = get_slot(tid);
+            if (!slot) {
+                std::fill_n(&region.counts_begin[tid * max_counters], max_counters, 0);
+                region.parent_work_first[tid] = no_work;
+                region.parent_work_last[tid] = 0;
+                continue;
+            }
+            std::copy_n(slot->counts, max_counters, &region.counts_begin[tid * max_counters]);
+            region.parent_work_first[tid] = slot->work_first;
+            region.parent_work_last[tid] = slot->work_last;
+            slot->work_first = no_work;
+            slot->work_last = 0;
+        }
+        // Latencies recorded so far belong to the enclosing region, or to no region at all
+        size_t num_latencies = latency_names.size();
+        region.latencies.resize(num_latencies);
+        for (hdr_histogram& h : region.latencies) { h.clear(); }
+        if (num_latencies > 0) {
+            region_frame* parent = depth > 1 ? &regions[depth - 2] : nullptr;
+            if (parent) { parent->latencies.resize(num_latencies); }
+            for (int tid = 0; tid < get_num_threads(); ++tid) {
+                thread_slot* slot = get_slot(tid);
+                if (!slot) { continue; }
+                for (size_t i = 0; i < num_latencies; ++i) {
+                    if (parent) { parent->latencies[i].merge(slot->latencies[i]); }
+                    slot->latencies[i].clear();
+                }
+            }
+        }
+        region.children.clear();
 
         // Start the ROI
-#if defined(ENABLE_SNIPER_HOOKS)
-        parmacs_roi_begin();
-#elif defined(ENABLE_GEM5_HOOKS)
-        m5_reset_stats(0,0);
-#elif defined(ENABLE_PIN_HOOKS)
-        __asm__("");
-#elif defined(ENABLE_PERF_HOOKS)
-        // We can only collect perf_group_size events at a time
-        // Collecting more events is done via multiple trials
-        trial = attrs.find("trial") != attrs.end() ? attrs["trial"].get<int>() : 0;
-        // After all event groups have been collected, start over with the first one
-        int trial_max = (perf_event_names.size() + perf_group_size - 1) / perf_group_size;
-        trial = trial % trial_max;
-        #pragma omp parallel
-        {
-            int tid = get_thread_id();
-            num_traversed_edges[tid] = 0;
-            perf.open(tid, trial, perf_group_size);
-            perf.start(tid, trial, perf_group_size);
+        // Only the outermost region starts the ROI, nested regions just take a snapshot
+        if (depth == 1) {
+            thread_kernel_tids.resize(get_num_threads());
+            for (int tid = 0; tid < get_num_threads(); ++tid) {
+                const thread_slot* slot = get_slot(tid);
+                thread_kernel_tids[tid] = slot ? slot->kernel_tid.load() : 0;
+            }
+        }
+        region_info info = {id, region_names[id], depth == 1, attrs, thread_kernel_tids};
+        backends.begin(info);
+        if (depth == 1) {
+            backend_counter_names.clear();
+            backends.names(backend_counter_names);
+        }
+        region.backend_begin.clear();
+        backends.collect(region.backend_begin);
+        region.backend_child.resize(region.backend_begin.size());
+        for (size_t c = 0; c < region.backend_child.size(); ++c) {
+            region.backend_child[c].assign(region.backend_begin[c].size(), 0);
         }
-#endif
         // Start the timer
-        t1 = std::chrono::steady_clock::now();
+        region.t1 = timer.now();
+        if (depth == 1 && sampler.joinable()) { start_sampling(region); }
     }
 
-    void __attribute__ ((noinline))
-    region_end()
+    // Sampler thread: every interval, record the progress of each thread in the open region
+    void
+    sample_loop()
     {
-        // Stop the timer
-        t2 = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(sample_mutex);
+        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+        while (!sampler_done) {
+            next += std::chrono::microseconds((int64_t)(sample_interval_ms * 1000));
+            sample_cv.wait_until(lock, next, [this] { return sampler_done; });
+            if (sample_active && !sampler_done) { take_sample(); }
+        }
+    }
 
-        // End the ROI
-#if defined(ENABLE_SNIPER_HOOKS)
-        parmacs_roi_end();
-#elif defined(ENABLE_GEM5_HOOKS)
-        m5_dumpreset_stats(0,0);
-#elif defined(ENABLE_PIN_HOOKS)
-        __asm__("");
-#elif defined(ENABLE_PERF_HOOKS)
-        #pragma omp parallel
-        {
-            int tid = get_thread_id();
-            perf.stop(tid, trial, perf_group_size);
+    // Append the current counter values to the sampled series, called with sample_mutex held
+    void
+    take_sample()
+    {
+        samples["time_ms"].push_back(timer.to_ms(timer.now() - sample_t1));
+        // Other threads keep counting while we read, their aligned 64-bit adds are not torn, so a relaxed load gets a recent value
+        json edges = json::array();
+        for (int tid = 0; tid < get_num_threads(); ++tid) {
+            const thread_slot* slot = get_slot(tid);
+            int64_t begin = (size_t)tid < sample_edges_begin.size() ? sample_edges_begin[tid] : 0;
+            edges.push_back(slot ? __atomic_load_n(&slot->counts[traversed_edges_counter], __ATOMIC_RELAXED) - begin : 0);
         }
-#endif
+        samples["num_traversed_edges"].push_back(edges);
+        vector<vector<uint64_t>> backend_values;
+        backends.sample(backend_values);
+        for (size_t c = 0; c < backend_values.size(); ++c) {
+            samples[backend_counter_names[c]].push_back(backend_values[c]);
+        }
+    }
 
-        // Populate the results object
-        json results = attrs;
+    void
+    start_sampling(const region_frame& region)
+    {
+        std::lock_guard<std::mutex> lock(sample_mutex);
+        sample_edges_begin.resize(region.counts_begin.size() / max_counters);
+        for (size_t tid = 0; tid < sample_edges_begin.size(); ++tid) {
+            sample_edges_begin[tid] = region.counts_begin[tid * max_counters + traversed_edges_counter];
+        }
+        sample_t1 = region.t1;
+        samples = json();
+        sample_active = true;
+    }
+
+    // Stop sampling, and return the series sampled during the region
+    json
+    stop_sampling()
+    {
+        std::lock_guard<std::mutex> lock(sample_mutex);
+        sample_active = false;
+        json result;
+        std::swap(result, samples);
+        return result;
+    }
+
+    void __attribute__ ((noinline))
+    region_end(region_id id)
+    {
+        // Stop the timer
+        hooks_timer::ticks t2 = timer.now();
 
         // Check for mismatched begin/end pairs
-        if (region_name == "") {
+        if (depth == 0) {
             cerr << "ERROR: called region_end before region_begin\n";
             exit(-1);
-        } else {
-            // Set region name in output and reset for next region
-            results["region_name"] = region_name;
-            region_name = "";
         }
+        if (id >= region_names.size()) {
+            cerr << "ERROR: region_end called with unknown region id " << id << "\n";
+            exit(-1);
+        }
+        region_frame& region = regions[depth - 1];
+        if (id != region.id) {
+            cerr << "ERROR: called region_end for " << region_names[id]
+                 << " inside region " << region_names[region.id] << "\n";
+            exit(-1);
+        }
+        bool outermost = depth == 1;
+        // Stop sampling before the counters are stopped
+        json region_samples;
+        if (outermost && sampler.joinable()) { region_samples = stop_sampling(); }
 
-        // Save # of traversed edges if the function was used
-        int64_t total_edges_traversed = 0;
-        for (int64_t n : num_traversed_edges) {
-            total_edges_traversed += n;
+        // End the ROI
+        region_info info = {id, region_names[id], outermost, attrs, thread_kernel_tids};
+        backends.end(info);
+        vector<vector<uint64_t>> backend_counters;
+        backends.collect(backend_counters);
+
+        // Compute inclusive and exclusive values for this region
+        double time_ms = timer.to_ms(t2 - region.t1);
+        // Threads that registered after the region began start from zero
+        int num_threads = get_num_threads();
+        size_t num_counters = counter_names.size();
+        region.counts_begin.resize(num_threads * max_counters, 0);
+        region.child_counts.resize(num_threads * max_counters, 0);
+        region.parent_work_first.resize(num_threads, no_work);
+        region.parent_work_last.resize(num_threads, 0);
+        // Work done by each thread [counter_id * num_threads + thread]
+        vector<int64_t>& counts = scratch.counts;
+        vector<int64_t>& exclusive_counts = scratch.exclusive_counts;
+        vector<int64_t>& total_counts = scratch.total_counts;
+        counts.resize(num_counters * num_threads);
+        exclusive_counts.resize(num_counters * num_threads);
+        total_counts.assign(num_counters, 0);
+        for (int tid = 0; tid < num_threads; ++tid) {
+            const thread_slot* slot = get_slot(tid);
+            for (size_t c = 0; c < num_counters; ++c) {
+                size_t i = tid * max_counters + c;
+                size_t j = c * num_threads + tid;
+                counts[j] = (slot ? slot->counts[c] : 0) - region.counts_begin[i];
+                exclusive_counts[j] = counts[j] - region.child_counts[i];
+                total_counts[c] += counts[j];
+            }
         }
-        if (total_edges_traversed > 0) {
-            results["num_traversed_edges"] = num_traversed_edges;
+        vector<vector<uint64_t>> exclusive_backend_counters = backend_counters;
+        for (size_t c = 0; c < backend_counters.size(); ++c) {
+            for (size_t tid = 0; tid < backend_counters[c].size(); ++tid) {
+                backend_counters[c][tid] -= region.backend_begin[c][tid];
+                exclusive_backend_counters[c][tid] = backend_counters[c][tid] - region.backend_child[c][tid];
+            }
+        }
+
+        // Merge per-thread operation latencies, including those from child regions
+        vector<hdr_histogram>& region_latencies = region.latencies;
+        size_t num_latencies = latency_names.size();
+        region_latencies.resize(num_latencies);
+        for (int tid = 0; tid < num_threads; ++tid) {
+            thread_slot* slot = get_slot(tid);
+            if (!slot) { continue; }
+            for (size_t i = 0; i < num_latencies; ++i) {
+                region_latencies[i].merge(slot->latencies[i]);
+                slot->latencies[i].clear();
+            }
+        }
+
+        // This region is part of the enclosing region's inclusive totals
+        if (!outermost) {
+            region_frame& parent = regions[depth - 2];
+            parent.latencies.resize(num_latencies);
+            for (size_t i = 0; i < num_latencies; ++i) {
+                parent.latencies[i].merge(region_latencies[i]);
+            }
+            parent.child_time_ms += time_ms;
+            parent.child_counts.resize(num_threads * max_counters, 0);
+            for (int tid = 0; tid < num_threads; ++tid) {
+                for (size_t c = 0; c < num_counters; ++c) {
+                    parent.child_counts[tid * max_counters + c] += counts[c * num_threads + tid];
+                }
+            }
+            for (size_t c = 0; c < backend_counters.size(); ++c) {
+                for (size_t tid = 0; tid < backend_counters[c].size(); ++tid) {
+                    parent.backend_child[c][tid] += backend_counters[c][tid];
+                }
+            }
+        }
+
+        // In aggregation mode, fold this region into its summary instead of writing a record
+        if (aggregate) {
+            region_summary& summary = summaries[std::make_pair(region.id, attrs_index)];
+            if (summary.time_ms.count() == 0) {
+                summary.id = region.id;
+                summary.attrs = get_attrs_snapshot();
+            }
+            summary.time_ms.add(time_ms);
+            summary.time_ns_histogram.add(time_ms * 1e6);
+            summary.counts.resize(num_counters);
+            for (size_t c = 0; c < num_counters; ++c) {
+                summary.counts[c].add(total_counts[c]);
+            }
+            summary.latencies.resize(num_latencies);
+            for (size_t i = 0; i < region_latencies.size(); ++i) {
+                summary.latencies[i].merge(region_latencies[i]);
+            }
+            for (size_t c = 0; c < backend_counters.size(); ++c) {
+                uint64_t total = 0;
+                for (uint64_t value : backend_counters[c]) { total += value; }
+                summary.values[backend_counter_names[c]].add(total);
+            }
+            for (const hooks_value_set::value& v : stats.values()) {
+                if (v.is_number()) {
+                    summary.values[*v.name].add(v.number());
+                }
+            }
+            stats.clear();
+            merge_work_spans(region);
+            depth -= 1;
+
+            if (aggregate_interval_ms > 0 && timer.to_ms(t2 - last_summary_time) >= aggregate_interval_ms) {
+                write_summaries();
+                last_summary_time = t2;
+            }
+            return;
+        }
+
+        // Populate the results object
+        // Attrs and stats are added by the writer, from the record's copy of them
+        // The record comes back from the writer once it is written out, so its buffers are reused
+        hooks_record record = out.take();
+        hooks_value_set& values = record.values;
+        json& results = record.fields;
+        record.attrs = get_attrs_snapshot();
+
+        // Set region name in output
+        const string& region_name = region_names[region.id];
+        values.set(region_name_key, region_name.data(), region_name.size());
+
+        // Save per-thread and total work for each counter that was used
+        for (size_t c = 0; c < num_counters; ++c) {
+            if (total_counts[c] != 0) {
+                values.set(&counter_names[c], &counts[c * num_threads], num_threads);
+                values.set(&counter_output_keys[c].total, total_counts[c]);
+            }
+        }
+
+        // Rate of work for each counter, over the whole region and by each thread
+        if (time_ms > 0) {
+            vector<double>& thread_rates = scratch.thread_rates;
+            thread_rates.resize(num_threads);
+            for (size_t c = 0; c < num_counters; ++c) {
+                if (total_counts[c] == 0) { continue; }
+                for (int tid = 0; tid < num_threads; ++tid) {
+                    thread_rates[tid] = counts[c * num_threads + tid] / (time_ms / 1000);
+                }
+                values.set(&counter_output_keys[c].rate, total_counts[c] / (time_ms / 1000));
+                values.set(&counter_output_keys[c].rate_per_thread, thread_rates.data(), num_threads);
+            }
         }
 
         // Record time elapsed
-        results["time_ms"] = std::chrono::duration<double, std::milli>(t2-t1).count();
+        values.set(time_ms_key, time_ms);
+        if (timer.is_cycle_counter()) {
+            values.set(time_cycles_key, (uint64_t)(t2 - region.t1));
+        }
+
+        // Summarize load balance if threads reported when they were working
+        hooks_timer::ticks latest_end = 0;
+        for (int tid = 0; tid < num_threads; ++tid) {
+            const thread_slot* slot = get_slot(tid);
+            if (slot && slot->work_first != no_work) { latest_end = std::max(latest_end, slot->work_last); }
+        }
+        if (latest_end > 0) {
+            vector<double>& busy_ms = scratch.busy_ms;
+            vector<double>& idle_ms = scratch.idle_ms;
+            busy_ms.assign(num_threads, 0);
+            idle_ms.assign(num_threads, 0);
+            double max_busy_ms = 0, total_busy_ms = 0;
+            int num_active_threads = 0;
+            for (int tid = 0; tid < num_threads; ++tid) {
+                const thread_slot* slot = get_slot(tid);
+                if (!slot || slot->work_first == no_work || slot->work_last < slot->work_first) { continue; }
+                busy_ms[tid] = timer.to_ms(slot->work_last - slot->work_first);
+                // Time spent waiting for the slowest thread to finish
+                idle_ms[tid] = timer.to_ms(latest_end - slot->work_last);
+                max_busy_ms = std::max(max_busy_ms, busy_ms[tid]);
+                total_busy_ms += busy_ms[tid];
+                num_active_threads += 1;
+            }
+            values.set(thread_busy_ms_key, busy_ms.data(), num_threads);
+            values.set(thread_idle_ms_key, idle_ms.data(), num_threads);
+            // Ratio of the slowest thread to the average, 1.0 is perfectly balanced
+            if (total_busy_ms > 0) {
+                values.set(imbalance_key, max_busy_ms / (total_busy_ms / num_active_threads));
+            }
+        }
+        merge_work_spans(region);
 
-        // Copy stats to the results object
-        for (json::iterator it = stats.begin(); it != stats.end(); ++it){
-            results[it.key()] = it.value();
+        // Latency percentiles for each operation recorded during the region
+        for (size_t i = 0; i < region_latencies.size(); ++i) {
+            if (region_latencies[i].count() > 0) {
+                results[latency_output_keys[i]] = region_latencies[i].to_json();
+            }
+        }
+
+        // Counter values sampled while the region was open
+        if (!region_samples.is_null()) {
+            results["samples"] = region_samples;
         }
+
         // Stats get cleared at the end of each region, attrs do not.
-        stats.clear();
+        std::swap(record.stats, stats);
 
-#if defined(ENABLE_PERF_HOOKS)
-        // Copy recorded counters into the output
-        json counters = json::parse(perf.toString(trial, perf_group_size));
-        for (json::iterator it = counters.begin(); it != counters.end(); ++it) {
-            results[it.key()] = it.value();
+        // Copy backend counters into the output
+        for (size_t c = 0; c < backend_counters.size(); ++c) {
+            results[backend_counter_names[c]] = backend_counters[c];
+        }
+        backends.annotate(results);
+
+        // Regions that contained other regions also report the portion not spent in any child
+        if (!region.children.empty()) {
+            json exclusive;
+            exclusive["time_ms"] = time_ms - region.child_time_ms;
+            for (size_t c = 0; c < num_counters; ++c) {
+                if (total_counts[c] != 0) {
+                    exclusive[counter_names[c]] = vector<int64_t>(
+                        exclusive_counts.begin() + c * num_threads, exclusive_counts.begin() + (c + 1) * num_threads);
+                }
+            }
+            for (size_t c = 0; c < exclusive_backend_counters.size(); ++c) {
+                exclusive[backend_counter_names[c]] = exclusive_backend_counters[c];
+            }
+            backends.annotate(exclusive);
+            results["exclusive"] = exclusive;
+            std::swap(record.children, region.children);
         }
-#endif
 
+        // Nested regions are attached to their parent, only complete trees are written out
+        depth -= 1;
+        if (!outermost) {
+            regions[depth - 1].children.push_back(std::move(record));
+            return;
+        }
+        write_results(record);
+    }
+
+    // Attrs as they are now, copied only when they have changed since the last call
+    std::shared_ptr<const hooks_value_set>
+    get_attrs_snapshot()
+    {
+        if (!attrs_snapshot) { attrs_snapshot = std::make_shared<hooks_value_set>(attrs); }
+        return attrs_snapshot;
+    }
+
+    // Activity in a region also counts towards the enclosing region
+    void
+    merge_work_spans(const region_frame& region)
+    {
+        for (size_t tid = 0; tid < region.parent_work_first.size(); ++tid) {
+            thread_slot* slot = get_slot(tid);
+            if (!slot) { continue; }
+            slot->work_first = std::min(slot->work_first, region.parent_work_first[tid]);
+            slot->work_last = std::max(slot->work_last, region.parent_work_last[tid]);
+        }
+    }
+
+    // Output key for the per-second rate of a counter, edges traversed give the usual TEPS
+    const string&
+    rate_name(counter_id c) const
+    {
+        return counter_output_keys[c].rate;
+    }
+
+    void
+    write_results(hooks_record& record)
+    {
 #if defined(USE_MPI)
         // Combine results from each rank so only rank 0 prints to stdout
+        record.fields = record.release_json();
+        json& results = record.fields;
         int rank, comm_size;
         MPI_Comm_rank(MPI_COMM_WORLD, &rank);
         MPI_Comm_size(MPI_COMM_WORLD, &comm_size);
@@ -239,8 +956,8 @@ class Hooks::impl
         int32_t local_string_length = local_results_string.size();
         vector<int32_t> string_lengths(comm_size);
         MPI_Gather(
-            &local_string_length, 1, MPI_INT64_T,
-            string_lengths.data(), 1, MPI_INT64_T,
+            &local_string_length, 1, MPI_INT32_T,
+            string_lengths.data(), 1, MPI_INT32_T,
             0, MPI_COMM_WORLD
         );
 
@@ -280,78 +997,236 @@ class Hooks::impl
             {
                 string key = it.key();
                 results[key] = json::array();
-                for (int i = 1; i < comm_size; ++i)
+                for (int i = 0; i < comm_size; ++i)
                 {
                     results[key] += results_by_pid[i][key];
                 }
             }
-        }
 
-#endif
+            // Summarize the rate of each rank, the harmonic mean is the one to use for rates over equal work
+            for (counter_id c = 0; c < counter_names.size(); ++c) {
+                string key = rate_name(c);
+                double sum = 0, inverse_sum = 0;
+                int num_ranks = 0;
+                for (int i = 0; i < comm_size; ++i) {
+                    if (!results_by_pid[i][key].is_number()) { continue; }
+                    double rate = results_by_pid[i][key].get<double>();
+                    sum += rate;
+                    inverse_sum += rate > 0 ? 1 / rate : std::numeric_limits<double>::infinity();
+                    num_ranks += 1;
+                }
+                if (num_ranks == 0) { continue; }
+                results[key + "_mean"] = sum / num_ranks;
+                results[key + "_hmean"] = num_ranks / inverse_sum;
+            }
+        }
 
-#if defined(HOOKS_PRETTY_PRINT)
-    // setw is overloaded to format json with indents
-    int indent = 2;
-#else
-    int indent = 0;
 #endif
 
-
 #if defined(USE_MPI)
     if (rank == 0){
 #endif
 
-        // At this point we've accumulated all the data for this ROI into a json object (results)
-        // Finally, send it to the output stream
-        out << std::setw(indent) << results << std::endl;
+        // At this point we've accumulated all the data for this ROI into a record
+        // Finally, hand it off to be written to the output stream
+        out.write(std::move(record));
 
 #if defined(USE_MPI)
     }
 #endif
+    }
 
+    // Write a record for each aggregated region, and start over with empty summaries
+    void
+    write_summaries()
+    {
+#if defined(USE_MPI)
+        // Summaries are not synchronized between ranks, so each rank writes its own
+        int rank = 0, initialized = 0, finalized = 0;
+        MPI_Initialized(&initialized);
+        MPI_Finalized(&finalized);
+        if (initialized && !finalized) { MPI_Comm_rank(MPI_COMM_WORLD, &rank); }
+#endif
+        for (auto it = summaries.begin(); it != summaries.end(); ++it) {
+            region_summary& summary = it->second;
+            json results;
+            summary.attrs->to_json(results);
+            results["region_name"] = region_names[summary.id];
+            results["count"] = summary.time_ms.count();
+            json time_ms = summary.time_ms.to_json();
+            time_ms["histogram_ns"] = summary.time_ns_histogram.to_json();
+            results["time_ms"] = time_ms;
+            for (size_t c = 0; c < summary.counts.size(); ++c) {
+                if (summary.counts[c].sum() != 0) {
+                    results[counter_names[c]] = summary.counts[c].to_json();
+                    if (summary.time_ms.sum() > 0) {
+                        results[rate_name(c)] = summary.counts[c].sum() / (summary.time_ms.sum() / 1000);
+                    }
+                }
+            }
+            for (auto v = summary.values.begin(); v != summary.values.end(); ++v) {
+                results[v->first] = v->second.to_json();
+            }
+            for (size_t i = 0; i < summary.latencies.size(); ++i) {
+                if (summary.latencies[i].count() > 0) {
+                    results[latency_output_keys[i]] = summary.latencies[i].to_json();
+                }
+            }
+#if defined(USE_MPI)
+            results["rank"] = rank;
+#endif
+            out.write(hooks_record(std::move(results)));
+        }
+        summaries.clear();
+    }
 
+    void
+    region_end()
+    {
+        if (depth == 0) {
+            cerr << "ERROR: called region_end before region_begin\n";
+            exit(-1);
+        }
+        region_end(regions[depth - 1].id);
     }
 
-    void traverse_edges(int64_t n) {
-        num_traversed_edges[get_thread_id()] += n;
+    void thread_work_begin() {
+        thread_slot& slot = get_current_slot();
+        if (slot.work_first == no_work) { slot.work_first = timer.now(); }
+    }
+    void thread_work_end() {
+        get_current_slot().work_last = timer.now();
+    }
+    latency_id
+    register_latency(const string& name)
+    {
+        std::lock_guard<std::mutex> lock(registration_mutex);
+        auto found = latency_ids.find(name);
+        if (found != latency_ids.end()) { return found->second; }
+        if (latency_names.full()) {
+            cerr << "ERROR: cannot register latency " << name << ", at most " << max_latencies << " latencies are supported\n";
+            exit(-1);
+        }
+        // Published before the name, so readers that see the name also see the key
+        latency_output_keys.push_back(name + "_latency_ns");
+        latency_id id = latency_names.push_back(name);
+        latency_ids[name] = id;
+        return id;
+    }
+    void record_latency(latency_id id, uint64_t ns) {
+        if (id >= max_latencies) { return; }
+        get_current_slot().latencies[id].add(ns);
+    }
+    uint64_t op_begin() {
+        return timer.now();
+    }
+    void op_end(latency_id id, uint64_t start) {
+        record_latency(id, timer.to_ns(timer.now() - start));
+    }
+    counter_id
+    register_counter(const string& name)
+    {
+        std::lock_guard<std::mutex> lock(registration_mutex);
+        auto found = counter_ids.find(name);
+        if (found != counter_ids.end()) { return found->second; }
+        if (counter_names.full()) {
+            cerr << "ERROR: cannot register counter " << name << ", at most " << max_counters << " counters are supported\n";
+            exit(-1);
+        }
+        // Published before the name, so readers that see the name also see the keys
+        counter_keys output_keys;
+        output_keys.total = name + "_total";
+        output_keys.rate = counter_names.size() == traversed_edges_counter ? "teps" : name + "_per_sec";
+        output_keys.rate_per_thread = output_keys.rate + "_per_thread";
+        counter_output_keys.push_back(output_keys);
+        counter_id id = counter_names.push_back(name);
+        counter_ids[name] = id;
+        return id;
+    }
+    void add_counter(counter_id id, int64_t n) {
+        int64_t* counts = get_current_slot().counts;
+        __atomic_store_n(&counts[id], counts[id] + n, __ATOMIC_RELAXED);
+    }
+public:
+    // Also called by the C interface, with the key as a const char*
+    template<typename K, typename T>
+    void
+    set_attr(const K& key, T value) {
+        attrs.set(keys.intern(key), value);
+        attrs_changed();
     }
-    template<typename T>
+    template<typename K>
     void
-    set_attr(std::string key, T value) {
-        attrs[key] = value;
+    set_attr(const K& key, const char* value, size_t n) {
+        attrs.set(keys.intern(key), value, n);
+        attrs_changed();
     }
-    template<typename T>
     void
-    set_stat(std::string key, T value) {
-        stats[key] = value;
+    attrs_changed() {
+        attrs_snapshot.reset();
+        if (aggregate) {
+            auto inserted = attrs_indices.insert(std::make_pair(attrs.signature(), attrs_indices.size()));
+            attrs_index = inserted.first->second;
+        }
+    }
+    template<typename K, typename T>
+    void
+    set_stat(const K& key, T value) {
+        stats.set(keys.intern(key), value);
+    }
+    template<typename K, typename T>
+    void
+    set_stat(const K& key, const T* value, size_t n) {
+        stats.set(keys.intern(key), value, n);
     }
 
 };
 
+const hooks_timer::ticks Hooks::impl::no_work;
+thread_local Hooks::impl::thread_slot* Hooks::impl::current_slot = nullptr;
+thread_local Hooks::impl::thread_exit_guard Hooks::impl::exit_guard;
+__thread int64_t* hooks_thread_counts = nullptr;
+
 // Implementation of Hooks
 // This is just a Singleton that forwards all calls to the private Hooks::implementation (impl)
 // This minimizes the number of code changes that need to be made in calling code
 
+std::atomic<Hooks*> Hooks::instance(nullptr);
+
 Hooks&
-Hooks::getInstance()
+Hooks::create_instance()
 {
-    static Hooks instance;
-    return instance;
+    static Hooks hooks;
+    instance.store(&hooks, std::memory_order_release);
+    return hooks;
 }
 
 Hooks::Hooks()                                              { pimpl = new Hooks::impl(); }
 Hooks::~Hooks()                                             { delete pimpl; }
-void Hooks::region_begin(string name)                       { pimpl->region_begin(name); }
+Hooks::region_id Hooks::register_region(const std::string& name) { return pimpl->register_region(name); }
+void Hooks::region_begin(string name)                       { pimpl->region_begin(pimpl->register_region(name)); }
+void Hooks::region_begin(region_id id)                      { pimpl->region_begin(id); }
 void Hooks::region_end()                                    { pimpl->region_end(); }
-void Hooks::set_attr(std::string key, uint64_t value)       { pimpl->set_attr(key, value); }
-void Hooks::set_attr(std::string key, int64_t value)        { pimpl->set_attr(key, value); }
-void Hooks::set_attr(std::string key, double value)         { pimpl->set_attr(key, value); }
-void Hooks::set_attr(std::string key, std::string value)    { pimpl->set_attr(key, value); }
-void Hooks::set_stat(std::string key, uint64_t value)       { pimpl->set_stat(key, value); }
-void Hooks::set_stat(std::string key, int64_t value)        { pimpl->set_stat(key, value); }
-void Hooks::set_stat(std::string key, double value)         { pimpl->set_stat(key, value); }
-void Hooks::set_stat(std::string key, std::string value)    { pimpl->set_stat(key, value); }
-void Hooks::traverse_edges(uint64_t n)                      { pimpl->traverse_edges(n); }
+void Hooks::region_end(region_id id)                        { pimpl->region_end(id); }
+void Hooks::set_attr(const std::string& key, uint64_t value) { pimpl->set_attr(key, value); }
+void Hooks::set_attr(const std::string& key, int64_t value) { pimpl->set_attr(key, value); }
+void Hooks::set_attr(const std::string& key, double value)  { pimpl->set_attr(key, value); }
+void Hooks::set_attr(const std::string& key, const std::string& value) { pimpl->set_attr(key, value.data(), value.size()); }
+void Hooks::set_stat(const std::string& key, uint64_t value) { pimpl->set_stat(key, value); }
+void Hooks::set_stat(const std::string& key, int64_t value) { pimpl->set_stat(key, value); }
+void Hooks::set_stat(const std::string& key, double value)  { pimpl->set_stat(key, value); }
+void Hooks::set_stat(const std::string& key, const std::string& value) { pimpl->set_stat(key, value.data(), value.size()); }
+void Hooks::set_stat_array(const std::string& key, const uint64_t* values, size_t n) { pimpl->set_stat(key, values, n); }
+void Hooks::set_stat_array(const std::string& key, const int64_t* values, size_t n) { pimpl->set_stat(key, values, n); }
+void Hooks::set_stat_array(const std::string& key, const double* values, size_t n) { pimpl->set_stat(key, values, n); }
+Hooks::counter_id Hooks::register_counter(const std::string& name) { return pimpl->register_counter(name); }
+void Hooks::add_counter_slow(counter_id id, int64_t n)      { pimpl->add_counter(id, n); }
+void Hooks::thread_work_begin()                             { pimpl->thread_work_begin(); }
+Hooks::latency_id Hooks::register_latency(const std::string& name) { return pimpl->register_latency(name); }
+void Hooks::record_latency(latency_id id, uint64_t ns)      { pimpl->record_latency(id, ns); }
+uint64_t Hooks::op_begin()                                  { return pimpl->op_begin(); }
+void Hooks::op_end(latency_id id, uint64_t start)           { pimpl->op_end(id, start); }
+void Hooks::thread_work_end()                               { pimpl->thread_work_end(); }
 
 // Implementation of C interface
 //
@@ -368,28 +1243,64 @@ hooks_region_end()
     Hooks::getInstance().region_end();
 }
 
+extern "C" hooks_region_id
+hooks_register_region(const char* name)
+{
+    return Hooks::getInstance().register_region(name);
+}
+
+extern "C" void
+hooks_region_begin_id(hooks_region_id id)
+{
+    Hooks::getInstance().region_begin(id);
+}
+
+extern "C" void
+hooks_region_end_id(hooks_region_id id)
+{
+    Hooks::getInstance().region_end(id);
+}
+
 extern "C" void
 hooks_set_attr_i64(const char * key, int64_t value)
 {
-    Hooks::getInstance().set_attr(key, value);
+    Hooks::getInstance().pimpl->set_attr(key, value);
 }
 
 extern "C" void
 hooks_set_attr_u64(const char * key, uint64_t value)
 {
-    Hooks::getInstance().set_attr(key, value);
+    Hooks::getInstance().pimpl->set_attr(key, value);
 }
 
 extern "C" void
 hooks_set_attr_f64(const char * key, double value)
 {
-    Hooks::getInstance().set_attr(key, value);
+    Hooks::getInstance().pimpl->set_attr(key, value);
 }
 
 extern "C" void
 hooks_set_attr_str(const char * key, const char* value)
 {
-    Hooks::getInstance().set_attr(key, value);
+    Hooks::getInstance().pimpl->set_attr(key, value, strlen(value));
+}
+
+extern "C" void
+hooks_set_stat_array_u64(const char * key, const uint64_t* values, size_t n)
+{
+    Hooks::getInstance().pimpl->set_stat(key, values, n);
+}
+
+extern "C" void
+hooks_set_stat_array_i64(const char * key, const int64_t* values, size_t n)
+{
+    Hooks::getInstance().pimpl->set_stat(key, values, n);
+}
+
+extern "C" void
+hooks_set_stat_array_f64(const char * key, const double* values, size_t n)
+{
+    Hooks::getInstance().pimpl->set_stat(key, values, n);
 }
 
 extern "C" void
@@ -397,3 +1308,51 @@ hooks_traverse_edges(uint64_t n)
 {
     Hooks::getInstance().traverse_edges(n);
 }
+
+extern "C" hooks_counter_id
+hooks_register_counter(const char* name)
+{
+    return Hooks::getInstance().register_counter(name);
+}
+
+extern "C" void
+hooks_add_counter(hooks_counter_id id, int64_t n)
+{
+    Hooks::getInstance().add_counter(id, n);
+}
+
+extern "C" void
+hooks_thread_work_begin()
+{
+    Hooks::getInstance().thread_work_begin();
+}
+
+extern "C" void
+hooks_thread_work_end()
+{
+    Hooks::getInstance().thread_work_end();
+}
+
+extern "C" hooks_latency_id
+hooks_register_latency(const char* name)
+{
+    return Hooks::getInstance().register_latency(name);
+}
+
+extern "C" void
+hooks_record_latency(hooks_latency_id id, uint64_t ns)
+{
+    Hooks::getInstance().record_latency(id, ns);
+}
+
+extern "C" uint64_t
+hooks_op_begin()
+{
+    return Hooks::getInstance().op_begin();
+}
+
+extern "C" void
+hooks_op_end(hooks_latency_id id, uint64_t start)
+{
+    Hooks::getInstance().op_end(id, start);
+}
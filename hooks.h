@@ -1,34 +1,164 @@
 #pragma once
 
 #include <string>
+#include <cstddef>
 #include <cstdint>
 
+#if defined(HOOKS_DISABLED)
+
+// Hooks compiled out (HOOKS_DISABLED): every call is an empty inline function, so instrumented code
+// compiles exactly as if the calls were not there. Arguments are taken by reference, so not even
+// a std::string is built for a region name. There is no library to link against.
 class Hooks
 {
 public:
+    typedef uint32_t region_id;
+    typedef uint32_t latency_id;
+    typedef uint32_t counter_id;
+    static const counter_id traversed_edges_counter = 0;
+    static Hooks& getInstance() { static Hooks instance; return instance; }
+    template<typename T> void region_begin(const T&) {}
+    void region_end() {}
+    void region_end(region_id) {}
+    template<typename T> region_id register_region(const T&) { return 0; }
+    class scoped_region
+    {
+    public:
+        explicit scoped_region(region_id) {}
+    private:
+        scoped_region(scoped_region const&);
+        scoped_region& operator=(scoped_region const&);
+    };
+    template<typename K, typename V> void set_attr(const K&, const V&) {}
+    template<typename K, typename V> void set_stat(const K&, const V&) {}
+    template<typename K, typename V> void set_stat_array(const K&, const V*, size_t) {}
+    void traverse_edges(uint64_t) {}
+    template<typename T> counter_id register_counter(const T&) { return 0; }
+    void add_counter(counter_id, int64_t) {}
+    void thread_work_begin() {}
+    void thread_work_end() {}
+    template<typename T> latency_id register_latency(const T&) { return 0; }
+    void record_latency(latency_id, uint64_t) {}
+    uint64_t op_begin() { return 0; }
+    void op_end(latency_id, uint64_t) {}
+private:
+    Hooks() = default;
+    Hooks(Hooks const&);
+    Hooks& operator=(Hooks const&);
+};
+
+#else
+
+#include <atomic>
+#include "hooks_c.h"
+
+// Work counters of the calling thread, indexed by counter_id, or nullptr until the thread first uses the hooks
+extern "C" __thread int64_t* hooks_thread_counts;
+
+class Hooks
+{
+public:
+    // Compact handle for a region name, see register_region
+    typedef uint32_t region_id;
+    // Compact handle for an operation name, see register_latency
+    typedef uint32_t latency_id;
+    // Compact handle for a work counter, see register_counter
+    typedef uint32_t counter_id;
+    // Counter used by traverse_edges
+    static const counter_id traversed_edges_counter = 0;
     // Singleton getter
-    static Hooks& getInstance();
+    // Inline, so that once the hooks have started this is a single load rather than a call
+    static Hooks& getInstance()
+    {
+        Hooks* hooks = instance.load(std::memory_order_acquire);
+        if (__builtin_expect(hooks != nullptr, 1)) { return *hooks; }
+        return create_instance();
+    }
     // Marks the start of a new phase of computation
+    // Regions may be nested, a region that begins inside another is reported as its child
     void region_begin(std::string name);
-    // Marks the end of the current phase of computation
+    // Marks the end of the current (innermost) phase of computation
     void region_end();
+    // Look up the ID for a region name, registering it on first use
+    // Beginning and ending a region by ID avoids building and comparing strings on every call
+    region_id register_region(const std::string& name);
+    void region_begin(region_id id);
+    // Ends the current region, which must have been started with the same ID
+    void region_end(region_id id);
+    // Begins a region when constructed and ends it when it goes out of scope
+    class scoped_region
+    {
+    public:
+        explicit scoped_region(region_id id) : id(id) { Hooks::getInstance().region_begin(id); }
+        ~scoped_region() { Hooks::getInstance().region_end(id); }
+    private:
+        region_id id;
+        scoped_region(scoped_region const&);
+        scoped_region& operator=(scoped_region const&);
+    };
     // Set a custom data value that will be included in the JSON output at the end of every region
-    void set_attr(std::string key, uint64_t value);
-    void set_attr(std::string key, int64_t value);
-    void set_attr(std::string key, double value);
-    void set_attr(std::string key, std::string value);
+    void set_attr(const std::string& key, uint64_t value);
+    void set_attr(const std::string& key, int64_t value);
+    void set_attr(const std::string& key, double value);
+    void set_attr(const std::string& key, const std::string& value);
     // Set a custom data value that will be included in the JSON output at the end of the next region
-    void set_stat(std::string key, uint64_t value);
-    void set_stat(std::string key, int64_t value);
-    void set_stat(std::string key, double value);
-    void set_stat(std::string key, std::string value);
+    void set_stat(const std::string& key, uint64_t value);
+    void set_stat(const std::string& key, int64_t value);
+    void set_stat(const std::string& key, double value);
+    void set_stat(const std::string& key, const std::string& value);
+    // Set a stat to an array of values (frontier size of each iteration, degree histogram, ...)
+    // The values are copied as they are, and only converted to json when the record is written out
+    void set_stat_array(const std::string& key, const uint64_t* values, size_t n);
+    void set_stat_array(const std::string& key, const int64_t* values, size_t n);
+    void set_stat_array(const std::string& key, const double* values, size_t n);
     // Record the traversal of an edge during an algorithm
-    void traverse_edges(uint64_t n);
+    void traverse_edges(uint64_t n) { add_counter(traversed_edges_counter, n); }
+    // Look up the ID for a named work counter (vertices visited, edges inserted, ...), registering it on first use
+    // Per-thread and total counts of each counter are added to the output of every region
+    counter_id register_counter(const std::string& name);
+    // Add to a counter from the calling thread, with no string handling or synchronization
+    // Inline, so once the thread has used the hooks this is a single add to its own counter
+    // The store is a relaxed atomic, since the sampler thread reads the counters while they are updated
+    void add_counter(counter_id id, int64_t n)
+    {
+        int64_t* counts = hooks_thread_counts;
+        if (__builtin_expect(counts != nullptr, 1)) { __atomic_store_n(&counts[id], counts[id] + n, __ATOMIC_RELAXED); }
+        else { add_counter_slow(id, n); }
+    }
+    // Mark when the calling thread starts and finishes its share of the work in the current region
+    // Each thread's busy time, time spent idle waiting for the slowest thread, and the
+    // overall imbalance are added to the region's output
+    void thread_work_begin();
+    void thread_work_end();
+    // Register a kind of operation whose latency will be measured, before recording it from any thread
+    // p50/p99/p99.9/max latency of each operation are added to the output of the enclosing region
+    latency_id register_latency(const std::string& name);
+    // Record the latency of a single operation, safe to call concurrently from all threads
+    void record_latency(latency_id id, uint64_t ns);
+    // Alternatively, time an operation: op_end(id, op_begin())
+    uint64_t op_begin();
+    void op_end(latency_id id, uint64_t start);
 private:
+    // Set once the instance has been constructed
+    static std::atomic<Hooks*> instance;
+    // First call to getInstance, constructs the instance
+    static Hooks& create_instance();
+    // First call from a thread, registers the thread and sets hooks_thread_counts
+    void add_counter_slow(counter_id id, int64_t n);
     Hooks();
     ~Hooks();
     Hooks(Hooks const&);
     Hooks& operator=(Hooks const&);
     class impl;
     impl * pimpl;
+    // The C interface calls into impl directly, to skip building std::strings
+    friend void hooks_set_attr_u64(const char*, uint64_t);
+    friend void hooks_set_attr_i64(const char*, int64_t);
+    friend void hooks_set_attr_f64(const char*, double);
+    friend void hooks_set_attr_str(const char*, const char*);
+    friend void hooks_set_stat_array_u64(const char*, const uint64_t*, size_t);
+    friend void hooks_set_stat_array_i64(const char*, const int64_t*, size_t);
+    friend void hooks_set_stat_array_f64(const char*, const double*, size_t);
 };
+
+#endif
@@ -0,0 +1,563 @@
+// Backends that do something at the start and end of each region, besides timing it
+//
+// Each backend is a class with the interface of no_backend. The backends enabled at
+// compile time (ENABLE_<TYPE>_HOOKS, from the HOOKS_TYPE list in CMake) are combined
+// with backend_list, and a disabled backend is an alias for no_backend, so calling
+// into the list costs nothing for backends that are not built in.
+//
+// Backends may also report counters. The hooks subtract the values collected when a
+// region begins from the values collected when it ends, and report the difference
+// (per thread) in the region's output, like the work counters.
+
+#ifndef HOOKS_BACKENDS_H
+#define HOOKS_BACKENDS_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <dlfcn.h>
+#include <sys/types.h>
+#include "hooks.h"
+#include "hooks_plugin.h"
+#include "hooks_values.h"
+#include "json.hpp"
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+// What a backend is told about a region as it begins or ends
+struct region_info
+{
+    Hooks::region_id id;
+    const std::string& name;
+    // Set for the outermost region, which starts and stops the ROI
+    bool outermost;
+    // Attributes currently set with set_attr
+    const hooks_value_set& attrs;
+    // Kernel ID (gettid) of each thread registered with the hooks, indexed by thread ID, 0 if not known yet
+    // The first threads are the OpenMP team, numbered like omp_get_thread_num
+    const std::vector<pid_t>& threads;
+};
+
+// A backend that does nothing, and the defaults for backends that only implement part of the interface
+class no_backend
+{
+public:
+    // Called when a region begins, just before its timer starts
+    void begin(const region_info&) {}
+    // Called when a region ends, just after its timer stops
+    void end(const region_info&) {}
+    // Append the names of the backend's counters, called once the outermost region has begun
+    void names(std::vector<std::string>&) {}
+    // Append the counter values saved by the last begin or end, one vector per counter with a value for each thread
+    void collect(std::vector<std::vector<uint64_t>>&) {}
+    // Append the current counter values, called from the sampler thread while the outermost region is open
+    void sample(std::vector<std::vector<uint64_t>>&) {}
+    // Add backend-specific fields to a region's output
+    void annotate(nlohmann::json&) {}
+};
+
+// All of the given backends, called in order when a region begins and in reverse order when it ends
+template<typename... Backends>
+class backend_list : public no_backend {};
+
+template<typename First, typename... Rest>
+class backend_list<First, Rest...>
+{
+public:
+    void begin(const region_info& region) { first.begin(region); rest.begin(region); }
+    void end(const region_info& region) { rest.end(region); first.end(region); }
+    void names(std::vector<std::string>& names) { first.names(names); rest.names(names); }
+    void collect(std::vector<std::vector<uint64_t>>& values) { first.collect(values); rest.collect(values); }
+    void sample(std::vector<std::vector<uint64_t>>& values) { first.sample(values); rest.sample(values); }
+    void annotate(nlohmann::json& results) { first.annotate(results); rest.annotate(results); }
+protected:
+    First first;
+    backend_list<Rest...> rest;
+};
+
+#if defined(ENABLE_SNIPER_HOOKS)
+#include <hooks_base.h>
+
+// Marks the region of interest in the Sniper simulator
+class sniper_backend : public no_backend
+{
+public:
+    void begin(const region_info& region) { if (region.outermost) { parmacs_roi_begin(); } }
+    void end(const region_info& region) { if (region.outermost) { parmacs_roi_end(); } }
+};
+#else
+typedef no_backend sniper_backend;
+#endif
+
+#if defined(ENABLE_GEM5_HOOKS)
+#include <util/m5/m5op.h>
+
+// Resets gem5's statistics when the ROI begins, and dumps them when it ends
+class gem5_backend : public no_backend
+{
+public:
+    void begin(const region_info& region) { if (region.outermost) { m5_reset_stats(0,0); } }
+    void end(const region_info& region) { if (region.outermost) { m5_dumpreset_stats(0,0); } }
+};
+#else
+typedef no_backend gem5_backend;
+#endif
+
+#if defined(ENABLE_PIN_HOOKS)
+// The Pin tool instruments region_begin and region_end directly, this just keeps the calls in place
+class pin_backend : public no_backend
+{
+public:
+    void begin(const region_info&) { __asm__(""); }
+    void end(const region_info&) { __asm__(""); }
+};
+#else
+typedef no_backend pin_backend;
+#endif
+
+#if defined(ENABLE_USDT_HOOKS)
+#include <sys/sdt.h>
+
+// Static tracepoints for perf, bpftrace, SystemTap, ...: hooks:region_begin and hooks:region_end, with the region ID and name
+class usdt_backend : public no_backend
+{
+public:
+    void begin(const region_info& region) { DTRACE_PROBE2(hooks, region_begin, region.id, region.name.c_str()); }
+    void end(const region_info& region) { DTRACE_PROBE2(hooks, region_end, region.id, region.name.c_str()); }
+};
+#else
+typedef no_backend usdt_backend;
+#endif
+
+#if defined(ENABLE_PERF_HOOKS)
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <perf.h>
+
+// Hardware counters read with perf_event_open, one set per thread registered with the hooks
+// Each thread's counters are opened, started and stopped by kernel thread ID from the thread
+// that begins and ends the outermost region, so the OpenMP team is not woken up to do it
+class perf_backend : public no_backend
+{
+public:
+    perf_backend()
+     : event_names(get_event_names())
+     , group_size(get_group_size())
+     , events(event_names, false)
+     , perf(max_threads(), events)
+     , trial(0)
+    {
+        // Without PERF_GROUP_SIZE, split the events into the fewest groups that never multiplex
+        if (group_size <= 0) {
+            events.pack_groups();
+            perf = gBenchPerf_multi(max_threads(), events);
+        }
+        perf.set_user_read(get_user_read());
+    }
+
+    void
+    begin(const region_info& region)
+    {
+        if (region.outermost) {
+            // We can only collect one group of events at a time
+            // Collecting more events is done via multiple trials
+            trial = region.attrs.get<int>("trial", 0);
+            // After all event groups have been collected, start over with the first one
+            int trial_max = std::max<int>(1, perf.get_group_cnt(group_size));
+            trial = trial % trial_max;
+            // Each thread's events stay open while the trial stays the same, and those of the last trial are closed when it changes
+            perf.resize(region.threads.size());
+            counting.assign(perf.get_thread_cnt(), false);
+            lost_threads.resize(perf.get_thread_cnt(), 0);
+            for (size_t tid = 0; tid < region.threads.size(); ++tid) {
+                // Threads that have not registered with the hooks yet are not counted
+                pid_t pid = region.threads[tid];
+                if (pid == 0 || pid == lost_threads[tid]) { continue; }
+                if (!perf.open(tid, trial, group_size, pid)) {
+                    std::cerr << "WARNING: cannot count perf events of thread " << tid
+                              << " (kernel thread " << pid << "), it has exited\n";
+                    lost_threads[tid] = pid;
+                    continue;
+                }
+                perf.start(tid, trial, group_size);
+                counting[tid] = true;
+            }
+        }
+        // Counters keep running, remember where they were when this region began
+        read();
+    }
+
+    void
+    end(const region_info& region)
+    {
+        if (region.outermost) {
+            for (size_t tid = 0; tid < counting.size(); ++tid) {
+                if (counting[tid]) { perf.stop(tid, trial, group_size); }
+            }
+        } else {
+            read();
+        }
+    }
+
+    void
+    names(std::vector<std::string>& names)
+    {
+        for (size_t i = event_begin(); i < event_end(); ++i) {
+            names.push_back(perf.event_name(i));
+        }
+    }
+
+    void
+    collect(std::vector<std::vector<uint64_t>>& values)
+    {
+        for (size_t i = event_begin(); i < event_end(); ++i) {
+            std::vector<uint64_t> counts(perf.get_thread_cnt());
+            for (size_t tid = 0; tid < counts.size(); ++tid) {
+                counts[tid] = perf.event_counter(tid, i);
+            }
+            values.push_back(counts);
+        }
+    }
+
+    void
+    sample(std::vector<std::vector<uint64_t>>& values)
+    {
+        // Read straight from the kernel, the values saved for collect belong to the application thread
+        for (size_t i = event_begin(); i < event_end(); ++i) {
+            std::vector<uint64_t> counts(perf.get_thread_cnt());
+            for (size_t tid = 0; tid < counts.size(); ++tid) {
+                counts[tid] = perf.peek(tid, i);
+            }
+            values.push_back(counts);
+        }
+    }
+
+    // Report whether any of the events were multiplexed, in the format of gBenchPerf_multi::toString
+    void
+    annotate(nlohmann::json& results)
+    {
+        bool mux = false;
+        for (size_t i = event_begin(); i < event_end(); ++i) {
+            for (size_t tid = 0; tid < perf.get_thread_cnt(); ++tid) {
+                mux |= perf.event_mux(tid, i);
+            }
+        }
+        results["MUX"] = mux;
+    }
+
+protected:
+    // Names of perf events to collect this run
+    std::vector<std::string> event_names;
+    // Number of perf events to collect each trial, or 0 to pack them automatically
+    int group_size;
+    gBenchPerf_event events;
+    gBenchPerf_multi perf;
+    int trial;
+    // Threads whose events are running during the current outermost region
+    std::vector<bool> counting;
+    // Kernel thread of each thread ID that had exited when its events were opened, which is not tried again
+    std::vector<pid_t> lost_threads;
+
+#if defined(_OPENMP)
+    static int max_threads() { return omp_get_max_threads(); }
+#else
+    static int max_threads() { return 1; }
+#endif
+
+    // Index of the first and one-past-last perf event collected during this trial
+    size_t event_begin() { size_t begin, end; perf.group_range(trial, group_size, begin, end); return begin; }
+    size_t event_end() { size_t begin, end; perf.group_range(trial, group_size, begin, end); return end; }
+
+    void
+    read()
+    {
+        for (size_t tid = 0; tid < counting.size(); ++tid) {
+            if (counting[tid]) { perf.read(tid, trial, group_size); }
+        }
+    }
+
+    static std::vector<std::string>
+    get_event_names()
+    {
+        std::vector<std::string> event_names = {"", "--perf-event"};
+        if (const char* env_names = getenv("PERF_EVENT_NAMES"))
+        {
+            char * names = new char[strlen(env_names) + 1];
+            strcpy(names, env_names);
+            char * p = strtok(names, " ");
+            while (p)
+            {
+                event_names.push_back(std::string(p));
+                p = strtok(NULL, " ");
+            }
+            delete[] names;
+
+        } else {
+            std::cerr << "WARNING: No perf events found in environment; set PERF_EVENT_NAMES.\n";
+        }
+        return event_names;
+    }
+
+    // PERF_RDPMC=1 reads counters from user space with rdpmc where the kernel allows it
+    static bool
+    get_user_read()
+    {
+        const char* env_rdpmc = getenv("PERF_RDPMC");
+        return env_rdpmc && atoi(env_rdpmc) != 0;
+    }
+
+    // PERF_GROUP_SIZE overrides the automatic packing with fixed slices of events
+    static int
+    get_group_size()
+    {
+        if (const char* env_group_size = getenv("PERF_GROUP_SIZE"))
+        {
+            return atoi(env_group_size);
+        } else {
+            return 0;
+        }
+    }
+};
+#else
+typedef no_backend perf_backend;
+#endif
+
+// Backend loaded at run time from the plugin named by HOOKS_BACKEND, if any
+class plugin_backend : public no_backend
+{
+public:
+    plugin_backend() : handle(nullptr), plugin(nullptr), state(nullptr), num_counters(0), num_threads(0)
+    {
+        const char* env_backend = getenv("HOOKS_BACKEND");
+        if (!env_backend || !*env_backend) { return; }
+        // A short name refers to one of the plugins built with the hooks
+        std::string filename = env_backend;
+        if (filename.find('/') == std::string::npos && filename.find(".so") == std::string::npos) {
+            filename = "libhooks_" + filename + ".so";
+        }
+        handle = dlopen(filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            std::cerr << "ERROR: cannot load HOOKS_BACKEND " << env_backend << ": " << dlerror() << "\n";
+            exit(-1);
+        }
+        hooks_plugin_entry_fn entry = (hooks_plugin_entry_fn)dlsym(handle, HOOKS_PLUGIN_ENTRY);
+        plugin = entry ? entry() : nullptr;
+        if (!plugin) {
+            std::cerr << "ERROR: " << filename << " is not a hooks plugin\n";
+            exit(-1);
+        }
+        if (plugin->abi_version != HOOKS_PLUGIN_ABI_VERSION) {
+            std::cerr << "ERROR: " << filename << " was built for plugin ABI version " << plugin->abi_version
+                      << ", expected " << HOOKS_PLUGIN_ABI_VERSION << "\n";
+            exit(-1);
+        }
+        if (plugin->create) { state = plugin->create(); }
+    }
+
+    ~plugin_backend()
+    {
+        if (plugin && plugin->destroy) { plugin->destroy(state); }
+        if (handle) { dlclose(handle); }
+    }
+
+    void
+    begin(const region_info& region)
+    {
+        if (!plugin) { return; }
+        if (plugin->begin) {
+            std::string attrs_json;
+            if (region.outermost) {
+                nlohmann::json attrs = nlohmann::json::object();
+                region.attrs.to_json(attrs);
+                attrs_json = attrs.dump();
+            }
+            hooks_plugin_region info = {
+                region.id, region.name.c_str(), region.outermost, region.outermost ? attrs_json.c_str() : NULL,
+                region.threads.data(), region.threads.size()
+            };
+            plugin->begin(state, &info);
+        }
+        if (region.outermost) {
+            num_counters = plugin->num_counters ? plugin->num_counters(state) : 0;
+            num_threads = plugin->num_threads ? plugin->num_threads(state) : 0;
+        }
+    }
+
+    void
+    end(const region_info& region)
+    {
+        if (!plugin || !plugin->end) { return; }
+        hooks_plugin_region info = {
+            region.id, region.name.c_str(), region.outermost, NULL, region.threads.data(), region.threads.size()
+        };
+        plugin->end(state, &info);
+    }
+
+    void
+    names(std::vector<std::string>& names)
+    {
+        for (size_t c = 0; c < num_counters && plugin->counter_name; ++c) {
+            names.push_back(plugin->counter_name(state, c));
+        }
+    }
+
+    void collect(std::vector<std::vector<uint64_t>>& values) { read(plugin ? plugin->collect : NULL, values); }
+    void sample(std::vector<std::vector<uint64_t>>& values) { read(plugin ? plugin->sample : NULL, values); }
+
+    void
+    annotate(nlohmann::json& results)
+    {
+        const char* fields = plugin && plugin->annotate ? plugin->annotate(state) : NULL;
+        if (!fields) { return; }
+        nlohmann::json extra = nlohmann::json::parse(fields);
+        for (nlohmann::json::iterator it = extra.begin(); it != extra.end(); ++it) {
+            results[it.key()] = it.value();
+        }
+    }
+
+protected:
+    void* handle;
+    const hooks_plugin* plugin;
+    void* state;
+    size_t num_counters;
+    size_t num_threads;
+
+    void
+    read(void (*read_values)(void*, uint64_t*), std::vector<std::vector<uint64_t>>& values)
+    {
+        if (!read_values || num_counters == 0) { return; }
+        std::vector<uint64_t> flat(num_counters * num_threads);
+        read_values(state, flat.data());
+        for (size_t c = 0; c < num_counters; ++c) {
+            values.push_back(std::vector<uint64_t>(flat.begin() + c * num_threads, flat.begin() + (c + 1) * num_threads));
+        }
+    }
+};
+
+// Every backend that was enabled at compile time, and the one loaded at run time
+typedef backend_list<sniper_backend, gem5_backend, pin_backend, perf_backend, usdt_backend, plugin_backend> hooks_backends;
+
+// Exposes a backend class through the plugin interface
+template<typename Backend>
+class plugin_adapter
+{
+public:
+    static const hooks_plugin*
+    get(const char* name)
+    {
+        static const hooks_plugin plugin = {
+            HOOKS_PLUGIN_ABI_VERSION, name, create, destroy, begin, end,
+            num_counters, num_threads, counter_name, collect, sample, annotate
+        };
+        return &plugin;
+    }
+
+protected:
+    struct state
+    {
+        Backend backend;
+        // Attributes of the outermost region, rebuilt from its json
+        hooks_key_table keys;
+        hooks_value_set attrs;
+        std::vector<pid_t> threads;
+        std::vector<std::string> names;
+        size_t num_threads;
+        std::string annotations;
+    };
+
+    static void* create() { return new state(); }
+    static void destroy(void* s) { delete static_cast<state*>(s); }
+
+    static void
+    begin(void* s, const hooks_plugin_region* region)
+    {
+        state& st = *static_cast<state*>(s);
+        std::string name = region->name;
+        if (region->attrs_json) {
+            st.attrs.clear();
+            nlohmann::json attrs = nlohmann::json::parse(region->attrs_json);
+            for (nlohmann::json::iterator it = attrs.begin(); it != attrs.end(); ++it) {
+                hooks_key_table::key k = st.keys.intern(it.key());
+                const nlohmann::json& v = it.value();
+                if (v.is_number_unsigned()) { st.attrs.set(k, v.get<uint64_t>()); }
+                else if (v.is_number_integer()) { st.attrs.set(k, v.get<int64_t>()); }
+                else if (v.is_number_float()) { st.attrs.set(k, v.get<double>()); }
+                else if (v.is_string()) { std::string s = v; st.attrs.set(k, s.data(), s.size()); }
+            }
+        }
+        st.threads.assign(region->threads, region->threads + region->num_threads);
+        region_info info = {region->id, name, region->outermost != 0, st.attrs, st.threads};
+        st.backend.begin(info);
+        if (region->outermost) {
+            st.names.clear();
+            st.backend.names(st.names);
+            std::vector<std::vector<uint64_t>> values;
+            st.backend.collect(values);
+            st.num_threads = values.empty() ? 0 : values[0].size();
+        }
+    }
+
+    static void
+    end(void* s, const hooks_plugin_region* region)
+    {
+        state& st = *static_cast<state*>(s);
+        std::string name = region->name;
+        st.threads.assign(region->threads, region->threads + region->num_threads);
+        region_info info = {region->id, name, region->outermost != 0, st.attrs, st.threads};
+        st.backend.end(info);
+    }
+
+    static size_t num_counters(void* s) { return static_cast<state*>(s)->names.size(); }
+    static size_t num_threads(void* s) { return static_cast<state*>(s)->num_threads; }
+    static const char* counter_name(void* s, size_t c) { return static_cast<state*>(s)->names[c].c_str(); }
+
+    static void
+    flatten(const state& st, const std::vector<std::vector<uint64_t>>& values, uint64_t* out)
+    {
+        for (size_t c = 0; c < values.size() && c < st.names.size(); ++c) {
+            for (size_t tid = 0; tid < values[c].size() && tid < st.num_threads; ++tid) {
+                out[c * st.num_threads + tid] = values[c][tid];
+            }
+        }
+    }
+
+    static void
+    collect(void* s, uint64_t* out)
+    {
+        state& st = *static_cast<state*>(s);
+        std::vector<std::vector<uint64_t>> values;
+        st.backend.collect(values);
+        flatten(st, values, out);
+    }
+
+    static void
+    sample(void* s, uint64_t* out)
+    {
+        state& st = *static_cast<state*>(s);
+        std::vector<std::vector<uint64_t>> values;
+        st.backend.sample(values);
+        flatten(st, values, out);
+    }
+
+    static const char*
+    annotate(void* s)
+    {
+        state& st = *static_cast<state*>(s);
+        nlohmann::json fields = nlohmann::json::object();
+        st.backend.annotate(fields);
+        if (fields.empty()) { return NULL; }
+        st.annotations = fields.dump();
+        return st.annotations.c_str();
+    }
+};
+
+// Defines the entry point of a plugin that wraps the given backend class
+#define HOOKS_DEFINE_PLUGIN(name, backend) \
+    extern "C" const hooks_plugin* hooks_plugin_entry() { return plugin_adapter<backend>::get(name); }
+
+#endif
@@ -1,19 +1,115 @@
 #ifndef HOOKS_C_H
 #define HOOKS_C_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Compact handle for a region name, see hooks_register_region
+typedef uint32_t hooks_region_id;
+// Compact handle for an operation name, see hooks_register_latency
+typedef uint32_t hooks_latency_id;
+// Compact handle for a work counter, see hooks_register_counter
+typedef uint32_t hooks_counter_id;
+
+#if defined(HOOKS_DISABLED)
+
+// Hooks compiled out (HOOKS_DISABLED): every call is an empty inline function
+static inline void hooks_region_begin(const char* name) { (void)name; }
+static inline void hooks_region_end() {}
+static inline hooks_region_id hooks_register_region(const char* name) { (void)name; return 0; }
+static inline void hooks_region_begin_id(hooks_region_id id) { (void)id; }
+static inline void hooks_region_end_id(hooks_region_id id) { (void)id; }
+static inline void hooks_set_attr_u64(const char * key, uint64_t value) { (void)key; (void)value; }
+static inline void hooks_set_attr_i64(const char * key, int64_t value) { (void)key; (void)value; }
+static inline void hooks_set_attr_f64(const char * key, double value) { (void)key; (void)value; }
+static inline void hooks_set_attr_str(const char * key, const char* value) { (void)key; (void)value; }
+static inline void hooks_set_stat_array_u64(const char * key, const uint64_t* values, size_t n) { (void)key; (void)values; (void)n; }
+static inline void hooks_set_stat_array_i64(const char * key, const int64_t* values, size_t n) { (void)key; (void)values; (void)n; }
+static inline void hooks_set_stat_array_f64(const char * key, const double* values, size_t n) { (void)key; (void)values; (void)n; }
+static inline void hooks_traverse_edges(uint64_t n) { (void)n; }
+static inline hooks_counter_id hooks_register_counter(const char* name) { (void)name; return 0; }
+static inline void hooks_add_counter(hooks_counter_id id, int64_t n) { (void)id; (void)n; }
+static inline void hooks_add_counter_inline(hooks_counter_id id, int64_t n) { (void)id; (void)n; }
+static inline void hooks_traverse_edges_inline(uint64_t n) { (void)n; }
+static inline void hooks_thread_work_begin() {}
+static inline void hooks_thread_work_end() {}
+static inline hooks_latency_id hooks_register_latency(const char* name) { (void)name; return 0; }
+static inline void hooks_record_latency(hooks_latency_id id, uint64_t ns) { (void)id; (void)ns; }
+static inline uint64_t hooks_op_begin() { return 0; }
+static inline void hooks_op_end(hooks_latency_id id, uint64_t start) { (void)id; (void)start; }
+
+#define HOOKS_SCOPED_REGION(id) ((void)(id))
+
+#else
+
 void hooks_region_begin(const char* name);
 void hooks_region_end();
+// Look up the ID for a region name, registering it on first use
+hooks_region_id hooks_register_region(const char* name);
+// Begin/end a region by ID, without any string handling
+void hooks_region_begin_id(hooks_region_id id);
+void hooks_region_end_id(hooks_region_id id);
 void hooks_set_attr_u64(const char * key, uint64_t value);
 void hooks_set_attr_i64(const char * key, int64_t value);
 void hooks_set_attr_f64(const char * key, double value);
 void hooks_set_attr_str(const char * key, const char* value);
+// Add an array of n values to the output of the current region, copied as they are and converted when written out
+void hooks_set_stat_array_u64(const char * key, const uint64_t* values, size_t n);
+void hooks_set_stat_array_i64(const char * key, const int64_t* values, size_t n);
+void hooks_set_stat_array_f64(const char * key, const double* values, size_t n);
 void hooks_traverse_edges(uint64_t n);
+// Named work counters, reported per thread and in total for each region
+hooks_counter_id hooks_register_counter(const char* name);
+void hooks_add_counter(hooks_counter_id id, int64_t n);
+
+// Work counters of the calling thread, indexed by hooks_counter_id, or null until the thread first uses the hooks
+extern __thread int64_t* hooks_thread_counts;
+
+// Inline versions of hooks_add_counter and hooks_traverse_edges for inner loops
+// Once the calling thread has used the hooks, these compile down to a single add
+// The counter is updated the same way as in Hooks::add_counter, see hooks.h
+static inline void
+hooks_add_counter_inline(hooks_counter_id id, int64_t n)
+{
+    int64_t* counts = hooks_thread_counts;
+    if (__builtin_expect(counts != 0, 1)) { __atomic_store_n(&counts[id], counts[id] + n, __ATOMIC_RELAXED); }
+    else { hooks_add_counter(id, n); }
+}
+
+static inline void
+hooks_traverse_edges_inline(uint64_t n)
+{
+    hooks_add_counter_inline(0, n);
+}
+
+void hooks_thread_work_begin();
+void hooks_thread_work_end();
+// Per-operation latency histograms, reported as percentiles in the enclosing region
+hooks_latency_id hooks_register_latency(const char* name);
+void hooks_record_latency(hooks_latency_id id, uint64_t ns);
+uint64_t hooks_op_begin();
+void hooks_op_end(hooks_latency_id id, uint64_t start);
+
+static inline void
+hooks_region_end_cleanup(const hooks_region_id* id)
+{
+    hooks_region_end_id(*id);
+}
+
+#define HOOKS_CONCAT_(a, b) a##b
+#define HOOKS_CONCAT(a, b) HOOKS_CONCAT_(a, b)
+
+// Begins a region and ends it automatically when the enclosing scope exits
+// Usage: { HOOKS_SCOPED_REGION(id); ... }
+#define HOOKS_SCOPED_REGION(id) \
+    const hooks_region_id HOOKS_CONCAT(hooks_scoped_region_, __LINE__) \
+    __attribute__ ((cleanup(hooks_region_end_cleanup))) = (hooks_region_begin_id(id), (id))
+
+#endif
 
 #ifdef __cplusplus
 }
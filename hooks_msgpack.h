@@ -0,0 +1,199 @@
+// MessagePack encoding of json records, for the compact binary output format
+// See https://github.com/msgpack/msgpack/blob/master/spec.md
+
+#ifndef HOOKS_MSGPACK_H
+#define HOOKS_MSGPACK_H
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <string>
+#include "json.hpp"
+
+class hooks_msgpack
+{
+public:
+    typedef nlohmann::json json;
+
+    // Append the encoding of a json value to the output buffer
+    static void pack(const json& value, std::string& out)
+    {
+        switch (value.type())
+        {
+            case json::value_t::null:
+                out.push_back((char)0xc0);
+                break;
+            case json::value_t::boolean:
+                out.push_back(value.get<bool>() ? (char)0xc3 : (char)0xc2);
+                break;
+            case json::value_t::number_unsigned:
+                pack_unsigned(value.get<uint64_t>(), out);
+                break;
+            case json::value_t::number_integer:
+            {
+                int64_t i = value.get<int64_t>();
+                if (i >= 0) { pack_unsigned(i, out); }
+                else if (i >= -32) { out.push_back((char)(0xe0 | (i + 32))); }
+                else if (i >= INT8_MIN) { out.push_back((char)0xd0); put_be(i, 1, out); }
+                else if (i >= INT16_MIN) { out.push_back((char)0xd1); put_be(i, 2, out); }
+                else if (i >= INT32_MIN) { out.push_back((char)0xd2); put_be(i, 4, out); }
+                else { out.push_back((char)0xd3); put_be(i, 8, out); }
+                break;
+            }
+            case json::value_t::number_float:
+            {
+                double d = value.get<double>();
+                uint64_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                out.push_back((char)0xcb);
+                put_be(bits, 8, out);
+                break;
+            }
+            case json::value_t::string:
+            {
+                const std::string& s = value.get_ref<const std::string&>();
+                pack_header(s.size(), 0xa0, 32, 0xd9, out);
+                out.append(s);
+                break;
+            }
+            case json::value_t::array:
+                pack_header(value.size(), 0x90, 16, 0, out);
+                for (const json& element : value) { pack(element, out); }
+                break;
+            case json::value_t::object:
+                pack_header(value.size(), 0x80, 16, 0, out);
+                for (json::const_iterator it = value.begin(); it != value.end(); ++it) {
+                    pack(json(it.key()), out);
+                    pack(it.value(), out);
+                }
+                break;
+            default:
+                out.push_back((char)0xc0);
+                break;
+        }
+    }
+
+    // Decode the next value from the stream
+    // Returns false at the end of the stream or if the data is malformed
+    static bool unpack(std::istream& in, json& value)
+    {
+        int tag = in.get();
+        if (tag == EOF) { return false; }
+        uint64_t n;
+
+        if (tag <= 0x7f) { value = (uint64_t)tag; return true; }
+        if (tag >= 0xe0) { value = (int64_t)(int8_t)tag; return true; }
+        if ((tag & 0xe0) == 0xa0) { return unpack_string(in, tag & 0x1f, value); }
+        if ((tag & 0xf0) == 0x90) { return unpack_array(in, tag & 0x0f, value); }
+        if ((tag & 0xf0) == 0x80) { return unpack_map(in, tag & 0x0f, value); }
+
+        switch (tag)
+        {
+            case 0xc0: value = nullptr; return true;
+            case 0xc2: value = false; return true;
+            case 0xc3: value = true; return true;
+            case 0xcc: if (!get_be(in, 1, n)) return false; value = n; return true;
+            case 0xcd: if (!get_be(in, 2, n)) return false; value = n; return true;
+            case 0xce: if (!get_be(in, 4, n)) return false; value = n; return true;
+            case 0xcf: if (!get_be(in, 8, n)) return false; value = n; return true;
+            case 0xd0: if (!get_be(in, 1, n)) return false; value = (int64_t)(int8_t)n; return true;
+            case 0xd1: if (!get_be(in, 2, n)) return false; value = (int64_t)(int16_t)n; return true;
+            case 0xd2: if (!get_be(in, 4, n)) return false; value = (int64_t)(int32_t)n; return true;
+            case 0xd3: if (!get_be(in, 8, n)) return false; value = (int64_t)n; return true;
+            case 0xca:
+            {
+                if (!get_be(in, 4, n)) return false;
+                uint32_t bits = n;
+                float f;
+                memcpy(&f, &bits, sizeof(f));
+                value = (double)f;
+                return true;
+            }
+            case 0xcb:
+            {
+                if (!get_be(in, 8, n)) return false;
+                double d;
+                memcpy(&d, &n, sizeof(d));
+                value = d;
+                return true;
+            }
+            case 0xd9: return get_be(in, 1, n) && unpack_string(in, n, value);
+            case 0xda: return get_be(in, 2, n) && unpack_string(in, n, value);
+            case 0xdb: return get_be(in, 4, n) && unpack_string(in, n, value);
+            case 0xdc: return get_be(in, 2, n) && unpack_array(in, n, value);
+            case 0xdd: return get_be(in, 4, n) && unpack_array(in, n, value);
+            case 0xde: return get_be(in, 2, n) && unpack_map(in, n, value);
+            case 0xdf: return get_be(in, 4, n) && unpack_map(in, n, value);
+            default: return false;
+        }
+    }
+
+protected:
+    static void put_be(uint64_t v, int bytes, std::string& out)
+    {
+        for (int i = bytes - 1; i >= 0; --i) { out.push_back((char)(v >> (8 * i))); }
+    }
+
+    static bool get_be(std::istream& in, int bytes, uint64_t& v)
+    {
+        v = 0;
+        for (int i = 0; i < bytes; ++i) {
+            int c = in.get();
+            if (c == EOF) { return false; }
+            v = (v << 8) | (uint8_t)c;
+        }
+        return true;
+    }
+
+    static void pack_unsigned(uint64_t u, std::string& out)
+    {
+        if (u <= 0x7f) { out.push_back((char)u); }
+        else if (u <= UINT8_MAX) { out.push_back((char)0xcc); put_be(u, 1, out); }
+        else if (u <= UINT16_MAX) { out.push_back((char)0xcd); put_be(u, 2, out); }
+        else if (u <= UINT32_MAX) { out.push_back((char)0xce); put_be(u, 4, out); }
+        else { out.push_back((char)0xcf); put_be(u, 8, out); }
+    }
+
+    // Strings, arrays and maps share a layout: a "fix" tag for small sizes, then 8 (strings only), 16 and 32-bit lengths
+    static void pack_header(size_t size, uint8_t fix_tag, size_t fix_max, uint8_t tag8, std::string& out)
+    {
+        // The 16 and 32-bit tags for arrays and maps follow the string tags in a fixed pattern
+        uint8_t tag16 = fix_tag == 0xa0 ? 0xda : fix_tag == 0x90 ? 0xdc : 0xde;
+        if (size < fix_max) { out.push_back((char)(fix_tag | size)); }
+        else if (tag8 && size <= UINT8_MAX) { out.push_back((char)tag8); put_be(size, 1, out); }
+        else if (size <= UINT16_MAX) { out.push_back((char)tag16); put_be(size, 2, out); }
+        else { out.push_back((char)(tag16 + 1)); put_be(size, 4, out); }
+    }
+
+    static bool unpack_string(std::istream& in, uint64_t n, json& value)
+    {
+        std::string s(n, '\0');
+        if (n > 0 && !in.read(&s[0], n)) { return false; }
+        value = s;
+        return true;
+    }
+
+    static bool unpack_array(std::istream& in, uint64_t n, json& value)
+    {
+        value = json::array();
+        for (uint64_t i = 0; i < n; ++i) {
+            json element;
+            if (!unpack(in, element)) { return false; }
+            value.push_back(element);
+        }
+        return true;
+    }
+
+    static bool unpack_map(std::istream& in, uint64_t n, json& value)
+    {
+        value = json::object();
+        for (uint64_t i = 0; i < n; ++i) {
+            json key, element;
+            if (!unpack(in, key) || !key.is_string() || !unpack(in, element)) { return false; }
+            value[key.get<std::string>()] = element;
+        }
+        return true;
+    }
+};
+
+#endif
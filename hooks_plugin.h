@@ -0,0 +1,70 @@
+// C interface of backend plugins, loaded at run time with HOOKS_BACKEND
+//
+// A plugin is a shared object that exports hooks_plugin_entry, returning a table of
+// callbacks. HOOKS_BACKEND is either a path to the shared object, or a short name such
+// as "perf", which loads libhooks_perf.so from the library search path. Any callback
+// may be NULL if the plugin has nothing to do there.
+//
+// Plugins built from a backend class in hooks_backends.h use HOOKS_DEFINE_PLUGIN,
+// see plugins/backend_plugin.cc.
+
+#ifndef HOOKS_PLUGIN_H
+#define HOOKS_PLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "hooks_c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bumped whenever struct hooks_plugin or struct hooks_plugin_region change
+#define HOOKS_PLUGIN_ABI_VERSION 2
+#define HOOKS_PLUGIN_ENTRY "hooks_plugin_entry"
+
+struct hooks_plugin_region
+{
+    hooks_region_id id;
+    const char* name;
+    // Nonzero for the outermost region, which starts and stops the ROI
+    int outermost;
+    // Attributes set with hooks_set_attr_* as a json object, for the outermost region only (NULL otherwise)
+    const char* attrs_json;
+    // Kernel ID (gettid) of each thread registered with the hooks, indexed by thread ID, 0 if not known yet
+    const pid_t* threads;
+    size_t num_threads;
+};
+
+struct hooks_plugin
+{
+    // HOOKS_PLUGIN_ABI_VERSION of the headers the plugin was built with
+    uint32_t abi_version;
+    const char* name;
+    // Create and destroy the plugin's state, which is passed to every other callback
+    void* (*create)(void);
+    void (*destroy)(void* state);
+    // Called when a region begins, just before its timer starts, and when it ends, just after its timer stops
+    void (*begin)(void* state, const struct hooks_plugin_region* region);
+    void (*end)(void* state, const struct hooks_plugin_region* region);
+    // Counters reported by the plugin, fixed from the time the outermost region begins until it ends
+    size_t (*num_counters)(void* state);
+    size_t (*num_threads)(void* state);
+    const char* (*counter_name)(void* state, size_t counter);
+    // Values saved by the last begin or end, written to values[counter * num_threads + thread]
+    void (*collect)(void* state, uint64_t* values);
+    // Current values, in the same layout, called from the sampler thread while the outermost region is open
+    void (*sample)(void* state, uint64_t* values);
+    // Extra fields for the region's output as a json object, or NULL
+    // The string belongs to the plugin and must stay valid until the next call
+    const char* (*annotate)(void* state);
+};
+
+typedef const struct hooks_plugin* (*hooks_plugin_entry_fn)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //HOOKS_PLUGIN_H
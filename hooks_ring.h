@@ -0,0 +1,172 @@
+// Crash-safe output: records are copied into a memory-mapped ring buffer file
+//
+// The file is a page-sized header followed by the data area. Each record is
+// prefixed by a ring_record header and padded to 8 bytes. When a record does not
+// fit before the end of the data area, the rest is marked as padding and the
+// record wraps to the start, overwriting the oldest records.
+//
+// A record is committed by storing its sequence number in the file header after
+// the record has been copied in. Because the file is a shared mapping, the
+// kernel writes the pages back even if the process is killed, with no fsync or
+// flush per record. Use tools/hooks_ring_reader to recover the committed records.
+
+#ifndef HOOKS_RING_H
+#define HOOKS_RING_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct ring_file_header
+{
+    char magic[8];
+    uint32_t version;
+    // Encoding of record payloads, see hooks_writer::output_format
+    uint32_t format;
+    // Size of the data area in bytes
+    uint64_t capacity;
+    // Sequence number of the last committed record, records are numbered from 1
+    uint64_t committed_seq;
+    // Offset in the data area where the next record will be written
+    uint64_t head;
+};
+
+struct ring_record
+{
+    uint32_t magic;
+    // Length of the payload in bytes, not including this header or padding
+    uint32_t length;
+    uint64_t seq;
+    // FNV-1a hash of the payload, used to reject records that were partially overwritten
+    uint64_t checksum;
+};
+
+class hooks_ring
+{
+public:
+    static const char* file_magic() { return "HOOKRING"; }
+    static const uint32_t file_version = 1;
+    static const uint32_t record_magic = 0x5245434b; // "KCER"
+    static const uint32_t padding_magic = 0x5044414b; // "KADP"
+    static const size_t header_size = 4096;
+
+    static uint64_t checksum(const char* data, size_t n)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < n; ++i) {
+            h ^= (uint8_t)data[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static size_t padded_size(size_t payload) { return sizeof(ring_record) + ((payload + 7) & ~(size_t)7); }
+
+    hooks_ring() : _fd(-1), _map(nullptr), _header(nullptr), _data(nullptr), _capacity(0) {}
+
+    ~hooks_ring()
+    {
+        if (_map) { munmap(_map, header_size + _capacity); }
+        if (_fd != -1) { close(_fd); }
+    }
+
+    // Map the ring file, creating it with the requested capacity if it does not already hold a compatible ring
+    bool open(const std::string& filename, uint64_t capacity, uint32_t format)
+    {
+        long page_size = sysconf(_SC_PAGESIZE);
+        capacity = (capacity + page_size - 1) / page_size * page_size;
+
+        _fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (_fd == -1) {
+            std::cerr << "ERROR: cannot open ring file " << filename << "\n";
+            return false;
+        }
+        struct stat st;
+        bool resume = false;
+        if (fstat(_fd, &st) == 0 && (uint64_t)st.st_size == header_size + capacity) {
+            ring_file_header existing;
+            if (pread(_fd, &existing, sizeof(existing), 0) == sizeof(existing)
+             && memcmp(existing.magic, file_magic(), sizeof(existing.magic)) == 0
+             && existing.version == file_version
+             && existing.format == format
+             && existing.capacity == capacity) {
+                // Keep the records from previous runs, and continue the sequence
+                resume = true;
+            }
+        }
+        if (!resume) {
+            if (ftruncate(_fd, 0) != 0 || ftruncate(_fd, header_size + capacity) != 0) {
+                std::cerr << "ERROR: cannot resize ring file " << filename << "\n";
+                return false;
+            }
+            // Preallocate the whole file so running out of disk space can't fault a later write
+            if (posix_fallocate(_fd, 0, header_size + capacity) != 0) {
+                std::cerr << "WARNING: cannot preallocate ring file " << filename << "\n";
+            }
+        }
+        _map = mmap(nullptr, header_size + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (_map == MAP_FAILED) {
+            _map = nullptr;
+            std::cerr << "ERROR: cannot map ring file " << filename << "\n";
+            return false;
+        }
+        _header = static_cast<ring_file_header*>(_map);
+        _data = static_cast<char*>(_map) + header_size;
+        _capacity = capacity;
+        if (!resume) {
+            memcpy(_header->magic, file_magic(), sizeof(_header->magic));
+            _header->version = file_version;
+            _header->format = format;
+            _header->capacity = capacity;
+            _header->committed_seq = 0;
+            _header->head = 0;
+        }
+        return true;
+    }
+
+    // Copy a record into the ring and commit it
+    void append(const char* payload, size_t length)
+    {
+        size_t size = padded_size(length);
+        if (size > _capacity) {
+            std::cerr << "WARNING: record of " << length << " bytes does not fit in the ring, dropping it\n";
+            return;
+        }
+        uint64_t head = _header->head;
+        if (head + size > _capacity) {
+            // Not enough room before the end, mark the rest as padding and wrap around
+            if (_capacity - head >= sizeof(ring_record)) {
+                ring_record* pad = reinterpret_cast<ring_record*>(_data + head);
+                pad->magic = padding_magic;
+                pad->length = _capacity - head - sizeof(ring_record);
+                pad->seq = 0;
+                pad->checksum = 0;
+            }
+            head = 0;
+        }
+        uint64_t seq = _header->committed_seq + 1;
+        ring_record* record = reinterpret_cast<ring_record*>(_data + head);
+        memcpy(_data + head + sizeof(ring_record), payload, length);
+        record->length = length;
+        record->seq = seq;
+        record->checksum = checksum(payload, length);
+        __atomic_store_n(&record->magic, record_magic, __ATOMIC_RELEASE);
+        // Publish the record
+        __atomic_store_n(&_header->head, (head + size) % _capacity, __ATOMIC_RELEASE);
+        __atomic_store_n(&_header->committed_seq, seq, __ATOMIC_RELEASE);
+    }
+
+protected:
+    int _fd;
+    void* _map;
+    ring_file_header* _header;
+    char* _data;
+    uint64_t _capacity;
+};
+
+#endif
@@ -0,0 +1,197 @@
+// Summary statistics used when aggregating repeated regions
+
+#ifndef HOOKS_STATS_H
+#define HOOKS_STATS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "json.hpp"
+
+// Streaming summary of a series of values
+// Mean and variance are updated with Welford's method, so they stay accurate over millions of values
+class running_stats
+{
+public:
+    running_stats()
+    : _count(0), _sum(0), _min(std::numeric_limits<double>::infinity())
+    , _max(-std::numeric_limits<double>::infinity()), _mean(0), _m2(0) {}
+
+    void add(double x)
+    {
+        _count += 1;
+        _sum += x;
+        _min = std::min(_min, x);
+        _max = std::max(_max, x);
+        double delta = x - _mean;
+        _mean += delta / _count;
+        _m2 += delta * (x - _mean);
+    }
+
+    uint64_t count() const { return _count; }
+    double sum() const { return _sum; }
+
+    nlohmann::json to_json() const
+    {
+        nlohmann::json result;
+        result["count"] = _count;
+        result["sum"] = _sum;
+        result["min"] = _min;
+        result["max"] = _max;
+        result["mean"] = _mean;
+        result["variance"] = _count > 1 ? _m2 / (_count - 1) : 0.0;
+        return result;
+    }
+
+protected:
+    uint64_t _count;
+    double _sum;
+    double _min;
+    double _max;
+    double _mean;
+    double _m2;
+};
+
+// Counts of values in power-of-two buckets: bucket i holds values in [2^(i-1), 2^i), bucket 0 holds zero
+class log2_histogram
+{
+public:
+    log2_histogram() : _buckets(65, 0) {}
+
+    void add(uint64_t v)
+    {
+        _buckets[v == 0 ? 0 : 64 - __builtin_clzll(v)] += 1;
+    }
+
+    // Non-empty buckets as parallel arrays of lower bounds and counts
+    nlohmann::json to_json() const
+    {
+        nlohmann::json lower_bounds = nlohmann::json::array(), counts = nlohmann::json::array();
+        for (size_t i = 0; i < _buckets.size(); ++i) {
+            if (_buckets[i] == 0) { continue; }
+            lower_bounds.push_back(i == 0 ? 0 : (uint64_t)1 << (i - 1));
+            counts.push_back(_buckets[i]);
+        }
+        nlohmann::json result;
+        result["lower_bound"] = lower_bounds;
+        result["count"] = counts;
+        return result;
+    }
+
+protected:
+    std::vector<uint64_t> _buckets;
+};
+
+// Running stats of a series together with its log2_histogram
+// Values are rounded to integers for the histogram, and negative values are left out of it
+class distribution
+{
+public:
+    void add(double x)
+    {
+        _stats.add(x);
+        if (x >= 0) { _histogram.add((uint64_t)std::llround(x)); }
+    }
+
+    uint64_t count() const { return _stats.count(); }
+    double sum() const { return _stats.sum(); }
+
+    nlohmann::json to_json() const
+    {
+        nlohmann::json result = _stats.to_json();
+        result["histogram"] = _histogram.to_json();
+        return result;
+    }
+
+protected:
+    running_stats _stats;
+    log2_histogram _histogram;
+};
+
+// Log-linear histogram in the style of HdrHistogram
+// Values below 256 are counted exactly, larger values are grouped into 128 buckets per power
+// of two, so any recorded value is reported to within 1%. Counts are only allocated on first use.
+class hdr_histogram
+{
+public:
+    hdr_histogram() : _count(0), _max(0) {}
+
+    void add(uint64_t v)
+    {
+        if (_counts.empty()) { _counts.resize(num_buckets, 0); }
+        _counts[index_of(v)] += 1;
+        _count += 1;
+        _max = std::max(_max, v);
+    }
+
+    void merge(const hdr_histogram& other)
+    {
+        if (other._count == 0) { return; }
+        if (_counts.empty()) { _counts.resize(num_buckets, 0); }
+        for (size_t i = 0; i < num_buckets; ++i) { _counts[i] += other._counts[i]; }
+        _count += other._count;
+        _max = std::max(_max, other._max);
+    }
+
+    void clear()
+    {
+        if (_count == 0) { return; }
+        std::fill(_counts.begin(), _counts.end(), 0);
+        _count = 0;
+        _max = 0;
+    }
+
+    uint64_t count() const { return _count; }
+
+    // Smallest value such that at least the fraction p of recorded values are less than or equal to it
+    uint64_t percentile(double p) const
+    {
+        if (_count == 0) { return 0; }
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(p * _count));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < num_buckets; ++i) {
+            seen += _counts[i];
+            if (seen >= rank) { return std::min(highest_equivalent_value(i), _max); }
+        }
+        return _max;
+    }
+
+    nlohmann::json to_json() const
+    {
+        nlohmann::json result;
+        result["count"] = _count;
+        result["p50"] = percentile(0.5);
+        result["p99"] = percentile(0.99);
+        result["p999"] = percentile(0.999);
+        result["max"] = _max;
+        return result;
+    }
+
+protected:
+    static const int sub_bucket_bits = 7;
+    static const uint64_t sub_bucket_count = 1 << sub_bucket_bits;
+    static const size_t num_buckets = 2 * sub_bucket_count + (64 - sub_bucket_bits - 1) * sub_bucket_count;
+
+    static size_t index_of(uint64_t v)
+    {
+        if (v < 2 * sub_bucket_count) { return v; }
+        int shift = 63 - __builtin_clzll(v) - sub_bucket_bits;
+        return 2 * sub_bucket_count + (shift - 1) * sub_bucket_count + ((v >> shift) - sub_bucket_count);
+    }
+
+    static uint64_t highest_equivalent_value(size_t i)
+    {
+        if (i < 2 * sub_bucket_count) { return i; }
+        int shift = (i - 2 * sub_bucket_count) / sub_bucket_count + 1;
+        uint64_t top = (i - 2 * sub_bucket_count) % sub_bucket_count + sub_bucket_count;
+        return ((top + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> _counts;
+    uint64_t _count;
+    uint64_t _max;
+};
+
+#endif
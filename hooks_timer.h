@@ -0,0 +1,150 @@
+// Timer used to measure the length of regions
+
+#ifndef HOOKS_TIMER_H
+#define HOOKS_TIMER_H
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+#if defined(HOOKS_USE_CYCLE_TIMER) && defined(__linux__)
+#include <sched.h>
+#endif
+
+#if defined(HOOKS_USE_CYCLE_TIMER) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+// By default, ticks are nanoseconds from std::chrono::steady_clock.
+// With HOOKS_USE_CYCLE_TIMER, ticks are read from the invariant TSC (x86) or the
+// virtual counter of the generic timer (aarch64), and converted to time using a
+// rate calibrated against steady_clock at startup.
+// If the cycle counter is missing or does not agree across cores, the timer
+// falls back to steady_clock.
+class hooks_timer
+{
+public:
+    typedef uint64_t ticks;
+
+    hooks_timer()
+    : _use_cycles(false), _ticks_per_ns(1.0)
+    {
+#if defined(HOOKS_USE_CYCLE_TIMER)
+        if (!has_invariant_counter()) {
+            std::cerr << "WARNING: No invariant cycle counter on this CPU, timing with steady_clock.\n";
+        } else if (!is_synchronized_across_cores()) {
+            std::cerr << "WARNING: Cycle counter is not synchronized across cores, timing with steady_clock.\n";
+        } else {
+            _ticks_per_ns = calibrate();
+            _use_cycles = true;
+        }
+#endif
+    }
+
+    ticks now() const
+    {
+#if defined(HOOKS_USE_CYCLE_TIMER)
+        if (_use_cycles) { return read_cycle_counter(); }
+#endif
+        return steady_ns();
+    }
+
+    double to_ms(ticks t) const { return t / _ticks_per_ns * 1e-6; }
+    uint64_t to_ns(ticks t) const { return t / _ticks_per_ns; }
+
+    // True if ticks are raw cycle counter values rather than nanoseconds
+    bool is_cycle_counter() const { return _use_cycles; }
+
+protected:
+    static ticks steady_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+#if defined(HOOKS_USE_CYCLE_TIMER)
+    static ticks read_cycle_counter()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        // lfence keeps rdtsc from executing before the preceding instructions
+        uint32_t lo, hi;
+        __asm__ __volatile__ ("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+        return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+        // isb keeps the counter read from being speculated early
+        uint64_t t;
+        __asm__ __volatile__ ("isb\n\tmrs %0, cntvct_el0" : "=r"(t) :: "memory");
+        return t;
+#else
+        return steady_ns();
+#endif
+    }
+
+    static bool has_invariant_counter()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        // CPUID.80000007H:EDX[8] indicates the TSC runs at a constant rate in all ACPI P-, C- and T-states
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) { return false; }
+        __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        return (edx >> 8) & 1;
+#elif defined(__aarch64__)
+        // The generic timer is architecturally required to run at a constant frequency
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Migrate to each core in turn, checking that the counter never runs backwards across a migration
+    static bool is_synchronized_across_cores()
+    {
+#if defined(__linux__)
+        cpu_set_t original;
+        if (sched_getaffinity(0, sizeof(original), &original) != 0) { return true; }
+        bool synchronized = true;
+        ticks last = read_cycle_counter();
+        for (int round = 0; round < 2 && synchronized; ++round) {
+            for (int cpu = 0; cpu < CPU_SETSIZE && synchronized; ++cpu) {
+                if (!CPU_ISSET(cpu, &original)) { continue; }
+                cpu_set_t one;
+                CPU_ZERO(&one);
+                CPU_SET(cpu, &one);
+                if (sched_setaffinity(0, sizeof(one), &one) != 0) { continue; }
+                ticks t = read_cycle_counter();
+                if (t < last) { synchronized = false; }
+                last = t;
+            }
+        }
+        sched_setaffinity(0, sizeof(original), &original);
+        return synchronized;
+#else
+        return true;
+#endif
+    }
+
+    // Measure the counter rate in ticks per nanosecond
+    static double calibrate()
+    {
+#if defined(__aarch64__)
+        // The counter frequency is published by firmware
+        uint64_t freq;
+        __asm__ __volatile__ ("mrs %0, cntfrq_el0" : "=r"(freq));
+        if (freq != 0) { return freq * 1e-9; }
+#endif
+        // Spin for a few milliseconds, sampling both clocks at each end
+        ticks ns1 = steady_ns(), c1 = read_cycle_counter();
+        ticks ns2, c2;
+        do {
+            ns2 = steady_ns();
+            c2 = read_cycle_counter();
+        } while (ns2 - ns1 < 20 * 1000 * 1000);
+        return (double)(c2 - c1) / (double)(ns2 - ns1);
+    }
+#endif
+
+    bool _use_cycles;
+    double _ticks_per_ns;
+};
+
+#endif
@@ -0,0 +1,209 @@
+// Attributes and stats, stored as flat arrays of typed values under interned keys
+//
+// set_attr and set_stat only overwrite or append a fixed-size entry, with no json nodes
+// or maps built. Values are converted to json when the record they belong to is written
+// out, on the writer thread.
+
+#ifndef HOOKS_VALUES_H
+#define HOOKS_VALUES_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "json.hpp"
+
+// Set of every key used so far, each stored once
+class hooks_key_table
+{
+public:
+    // Interned keys are compared by address, and stay valid for the life of the table
+    // Nodes of an unordered_set never move, so other threads may read a key while new ones are added
+    typedef const std::string* key;
+
+    key intern(const std::string& name) { return &*_keys.insert(name).first; }
+
+    key intern(const char* name)
+    {
+        // Most keys are string literals, so look them up by address before hashing the contents
+        auto it = _by_address.find(name);
+        if (it != _by_address.end() && *it->second == name) { return it->second; }
+        key k = intern(std::string(name));
+        _by_address[name] = k;
+        return k;
+    }
+
+protected:
+    std::unordered_set<std::string> _keys;
+    std::unordered_map<const char*, key> _by_address;
+};
+
+// Values set under interned keys, in the order they were first set
+class hooks_value_set
+{
+public:
+    typedef hooks_key_table::key key;
+    enum value_type : uint8_t { U64, I64, F64, STR, U64_ARRAY, I64_ARRAY, F64_ARRAY };
+    struct value
+    {
+        key name;
+        value_type type;
+        union { uint64_t u64; int64_t i64; double f64; };
+        // Bytes of a string or array in the set's data buffer
+        size_t begin, size;
+
+        bool is_number() const { return type == U64 || type == I64 || type == F64; }
+        double number() const { return type == U64 ? (double)u64 : type == I64 ? (double)i64 : f64; }
+    };
+
+    void set(key k, uint64_t x) { slot(k, U64).u64 = x; }
+    void set(key k, int64_t x) { slot(k, I64).i64 = x; }
+    void set(key k, double x) { slot(k, F64).f64 = x; }
+
+    void set(key k, const char* s, size_t n) { set_bytes(k, STR, s, n); }
+    // Arrays are copied as raw bytes, and only converted element by element when written out
+    void set(key k, const uint64_t* a, size_t n) { set_bytes(k, U64_ARRAY, a, n * sizeof(*a)); }
+    void set(key k, const int64_t* a, size_t n) { set_bytes(k, I64_ARRAY, a, n * sizeof(*a)); }
+    void set(key k, const double* a, size_t n) { set_bytes(k, F64_ARRAY, a, n * sizeof(*a)); }
+
+    // Remove every value, keeping the memory for the next ones
+    void clear() { _values.clear(); _data.clear(); }
+    bool empty() const { return _values.empty(); }
+    const std::vector<value>& values() const { return _values; }
+
+    // Value set under a name, or nullptr
+    const value*
+    find(const std::string& name) const
+    {
+        for (const value& v : _values) {
+            if (*v.name == name) { return &v; }
+        }
+        return nullptr;
+    }
+
+    template<typename T>
+    T
+    get(const std::string& name, T default_value) const
+    {
+        const value* v = find(name);
+        return v && v->is_number() ? (T)v->number() : default_value;
+    }
+
+    // Add every value to a json object, optionally keeping fields that are already there
+    void
+    to_json(nlohmann::json& out, bool replace = true) const
+    {
+        for (const value& v : _values) {
+            if (!replace && out.find(*v.name) != out.end()) { continue; }
+            nlohmann::json& field = out[*v.name];
+            switch (v.type) {
+                case U64: field = v.u64; break;
+                case I64: field = v.i64; break;
+                case F64: field = v.f64; break;
+                case STR: field = std::string(_data.data() + v.begin, v.size); break;
+                case U64_ARRAY: field = array_to_json<uint64_t>(v); break;
+                case I64_ARRAY: field = array_to_json<int64_t>(v); break;
+                case F64_ARRAY: field = array_to_json<double>(v); break;
+            }
+        }
+    }
+
+    // Bytes that are equal for sets with the same values, regardless of the order they were set in
+    std::string
+    signature() const
+    {
+        std::vector<const value*> sorted;
+        for (const value& v : _values) { sorted.push_back(&v); }
+        std::sort(sorted.begin(), sorted.end(), [](const value* a, const value* b) { return a->name < b->name; });
+        std::string bytes;
+        for (const value* v : sorted) {
+            bytes.append((const char*)&v->name, sizeof(v->name));
+            bytes.push_back((char)v->type);
+            if (!v->is_number()) {
+                bytes.append((const char*)&v->size, sizeof(v->size));
+                bytes.append(_data.data() + v->begin, v->size);
+            } else {
+                bytes.append((const char*)&v->u64, sizeof(v->u64));
+            }
+        }
+        return bytes;
+    }
+
+protected:
+    std::vector<value> _values;
+    // Contents of strings and arrays
+    std::vector<char> _data;
+
+    // Entry for a key, added if it is not set yet
+    // Sets hold a handful of values, a linear search is faster than hashing
+    value&
+    slot(key k, value_type type)
+    {
+        for (value& v : _values) {
+            if (v.name == k) {
+                if (v.type != type) { v.type = type; v.size = 0; }
+                return v;
+            }
+        }
+        value v;
+        v.name = k;
+        v.type = type;
+        v.u64 = 0;
+        v.begin = 0;
+        v.size = 0;
+        _values.push_back(v);
+        return _values.back();
+    }
+
+    void
+    set_bytes(key k, value_type type, const void* bytes, size_t n)
+    {
+        value& v = slot(k, type);
+        // Reuse the old bytes of the value when they are big enough, otherwise append
+        if (n > v.size) {
+            if (_data.size() + n > 2 * live_bytes() + 4096) { compact(); }
+            v.begin = _data.size();
+            _data.resize(_data.size() + n);
+        }
+        if (n > 0) { memcpy(&_data[v.begin], bytes, n); }
+        v.size = n;
+    }
+
+    // The data buffer has no alignment, so the elements are copied out before converting them
+    template<typename T>
+    nlohmann::json
+    array_to_json(const value& v) const
+    {
+        size_t n = v.size / sizeof(T);
+        std::vector<T> elements(n);
+        if (n > 0) { memcpy(elements.data(), _data.data() + v.begin, n * sizeof(T)); }
+        return nlohmann::json(elements);
+    }
+
+    size_t
+    live_bytes() const
+    {
+        size_t n = 0;
+        for (const value& v : _values) { n += v.size; }
+        return n;
+    }
+
+    // Drop the bytes of strings and arrays that have been overwritten
+    void
+    compact()
+    {
+        std::vector<char> data;
+        data.reserve(live_bytes());
+        for (value& v : _values) {
+            size_t begin = data.size();
+            data.insert(data.end(), _data.begin() + v.begin, _data.begin() + v.begin + v.size);
+            v.begin = begin;
+        }
+        _data.swap(data);
+    }
+};
+
+#endif
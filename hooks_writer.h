@@ -0,0 +1,270 @@
+// Background thread that writes region records to the output file
+
+#ifndef HOOKS_WRITER_H
+#define HOOKS_WRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "json.hpp"
+#include "hooks_msgpack.h"
+#include "hooks_ring.h"
+#include "hooks_values.h"
+
+// Output of a region, as handed to the writer
+// Attrs, stats and most computed fields are kept in their flat form, and only converted to json by the writer
+struct hooks_record
+{
+    // Fields computed when the region ended that do not fit in values (nested objects, backend output)
+    nlohmann::json fields;
+    // Fields computed when the region ended, under keys that stay valid for the life of the hooks
+    hooks_value_set values;
+    // Attributes at the time the region ended, shared by every record until the next set_attr
+    std::shared_ptr<const hooks_value_set> attrs;
+    // Stats set during the region
+    hooks_value_set stats;
+    // Records of nested regions
+    std::vector<hooks_record> children;
+
+    hooks_record() {}
+    explicit hooks_record(nlohmann::json&& fields) : fields(std::move(fields)) {}
+
+    // Convert to a single json object, leaving the record empty but keeping its memory for reuse
+    // Computed fields take precedence over attrs, and stats over both
+    nlohmann::json
+    release_json()
+    {
+        nlohmann::json out = std::move(fields);
+        values.to_json(out);
+        if (attrs) { attrs->to_json(out, false); }
+        stats.to_json(out);
+        if (!children.empty()) {
+            nlohmann::json& out_children = out["children"] = nlohmann::json::array();
+            for (hooks_record& child : children) { out_children.push_back(child.release_json()); }
+        }
+        fields = nlohmann::json();
+        values.clear();
+        attrs.reset();
+        stats.clear();
+        children.clear();
+        return out;
+    }
+};
+
+// Bounded lock-free queue with exactly one producer thread and one consumer thread
+template<typename T>
+class spsc_queue
+{
+public:
+    explicit spsc_queue(size_t capacity)
+    : _slots(round_up_pow2(capacity)), _mask(_slots.size() - 1), _head(0), _tail(0) {}
+
+    // Called by the producer, returns false if the queue is full
+    bool try_push(T&& value)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) == _slots.size()) { return false; }
+        _slots[tail & _mask] = std::move(value);
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Called by the consumer, returns false if the queue is empty
+    bool try_pop(T& value)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire)) { return false; }
+        value = std::move(_slots[head & _mask]);
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+    }
+
+protected:
+    static size_t round_up_pow2(size_t n)
+    {
+        size_t p = 1;
+        while (p < n) { p <<= 1; }
+        return p;
+    }
+
+    std::vector<T> _slots;
+    size_t _mask;
+    // Head and tail are written by different threads, keep them on separate cache lines
+    std::atomic<size_t> _head;
+    char _pad[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> _tail;
+};
+
+// Serializes and writes records on a background thread, so region_end only has to enqueue them
+//
+// Records are written either as json text, one per line, or as a stream of MessagePack objects
+//
+// If a ring size is given, records are instead copied straight into a memory-mapped
+// ring file (see hooks_ring.h), with no background thread, so that they survive
+// the process being killed.
+//
+// The output is flushed when the writer is destroyed, and also:
+//   HOOKS_FLUSH_RECORDS=N  after every N records
+//   HOOKS_FLUSH_MS=T       when records have been waiting for at least T milliseconds
+class hooks_writer
+{
+public:
+    typedef hooks_record record;
+    enum output_format { JSON, MSGPACK };
+
+    hooks_writer(const std::string& filename, output_format format, int indent, uint64_t ring_size)
+    : _format(format)
+    , _indent(indent)
+    , _flush_records(get_env_int("HOOKS_FLUSH_RECORDS", 0))
+    , _flush_ms(get_env_int("HOOKS_FLUSH_MS", 0))
+    , _queue(1024)
+    , _free(1024)
+    , _sleeping(false)
+    , _stopping(false)
+    {
+        if (ring_size > 0) {
+            _ring.reset(new hooks_ring());
+            if (!_ring->open(filename, ring_size, format)) { exit(-1); }
+        } else {
+            _out.open(filename, format == MSGPACK ? std::ofstream::app | std::ofstream::binary : std::ofstream::app);
+            _thread = std::thread(&hooks_writer::run, this);
+        }
+    }
+
+    // Waits for all queued records to be written out
+    ~hooks_writer()
+    {
+        if (!_thread.joinable()) { return; }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _wakeup.notify_one();
+        _thread.join();
+    }
+
+    // Empty record to fill in, reusing the memory of one that has already been written out if there is one
+    // Must be called from the thread that calls write
+    record take()
+    {
+        record r;
+        _free.try_pop(r);
+        return r;
+    }
+
+    // Queue a record to be written, only blocks if the writer has fallen far behind
+    void write(record&& r)
+    {
+        if (_ring) {
+            encode_record(r);
+            _ring->append(_buffer.data(), _buffer.size());
+            _free.try_push(std::move(r));
+            return;
+        }
+        while (!_queue.try_push(std::move(r))) {
+            std::this_thread::yield();
+        }
+        // Pairs with the fence in run(), so either we see the writer is asleep or it sees the new record
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _wakeup.notify_one();
+        }
+    }
+
+protected:
+    static int get_env_int(const char* name, int default_value)
+    {
+        const char* value = getenv(name);
+        return value ? atoi(value) : default_value;
+    }
+
+    void encode_record(record& r)
+    {
+        nlohmann::json j = r.release_json();
+        if (_format == MSGPACK) {
+            _buffer.clear();
+            hooks_msgpack::pack(j, _buffer);
+        } else {
+            _buffer = _indent > 0 ? j.dump(_indent) : j.dump();
+        }
+    }
+
+    void write_record(record& r)
+    {
+        encode_record(r);
+        _out.write(_buffer.data(), _buffer.size());
+        if (_format == JSON) { _out.put('\n'); }
+    }
+
+    void run()
+    {
+        typedef std::chrono::steady_clock clock;
+        int unflushed = 0;
+        clock::time_point first_unflushed;
+        record r;
+        while (true) {
+            if (_queue.try_pop(r)) {
+                write_record(r);
+                // Hand the emptied record back, so the next region can fill it in without allocating
+                _free.try_push(std::move(r));
+                if (unflushed++ == 0) { first_unflushed = clock::now(); }
+                if (_flush_records > 0 && unflushed >= _flush_records) {
+                    _out.flush();
+                    unflushed = 0;
+                }
+            } else {
+                // Nothing to write, sleep until more records arrive or a flush is due
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (_stopping) { break; }
+                _sleeping.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (_queue.empty()) {
+                    _wakeup.wait_for(lock, std::chrono::milliseconds(_flush_ms > 0 ? _flush_ms : 100));
+                }
+                _sleeping.store(false, std::memory_order_relaxed);
+            }
+            if (_flush_ms > 0 && unflushed > 0
+             && clock::now() - first_unflushed >= std::chrono::milliseconds(_flush_ms)) {
+                _out.flush();
+                unflushed = 0;
+            }
+        }
+        // The producer has stopped, drain whatever is left
+        while (_queue.try_pop(r)) {
+            write_record(r);
+        }
+        _out.flush();
+    }
+
+    std::ofstream _out;
+    std::unique_ptr<hooks_ring> _ring;
+    output_format _format;
+    int _indent;
+    // Reused for encoding binary records
+    std::string _buffer;
+    int _flush_records;
+    int _flush_ms;
+    spsc_queue<record> _queue;
+    // Records that have been written out, going back from the writer thread to be reused
+    spsc_queue<record> _free;
+    std::atomic<bool> _sleeping;
+    bool _stopping;
+    std::mutex _mutex;
+    std::condition_variable _wakeup;
+    std::thread _thread;
+};
+
+#endif
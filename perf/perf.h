@@ -8,15 +8,20 @@
 #include <linux/perf_event.h>
 #include <asm/unistd.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include <string>
 #include <iostream>
 #include <vector>
+#include <deque>
 #include <stdio.h>
 #include <cstring>
 #include <string.h>
 #include <sstream>
+#include <algorithm>
 
 #ifndef NO_PFM
 #include "pfm_cxx.h"
@@ -76,15 +81,91 @@ struct read_format {
     unsigned long long id;            /* if PERF_FORMAT_ID */
 };
 
+// Layout of a read from a group leader with PERF_FORMAT_GROUP:
+//     nr, time_enabled, time_running, then { value, id } for each event in the group
+#define PERF_GROUP_READ_HEADER 3
+#define PERF_GROUP_READ_WORDS(nr) (PERF_GROUP_READ_HEADER + 2 * (nr))
+
+// Kernel ID of the calling thread
+static inline pid_t perf_current_tid(void)
+{
+    static __thread pid_t tid = 0;
+    if (tid == 0) tid = syscall(SYS_gettid);
+    return tid;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PERF_HAVE_RDPMC 1
+static inline unsigned long long perf_rdpmc(unsigned int counter)
+{
+    unsigned int low, high;
+    __asm__ __volatile__("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+    return low | ((unsigned long long)high << 32);
+}
+static inline unsigned long long perf_rdtsc(void)
+{
+    unsigned int low, high;
+    __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+    return low | ((unsigned long long)high << 32);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+// Number of general purpose and fixed function counters of the core PMU, both 0 if unknown
+static inline void perf_pmu_counters(unsigned int& general, unsigned int& fixed)
+{
+    general = 0;
+    fixed = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx)) return;
+    unsigned int max_leaf = eax;
+    if (ebx == 0x68747541) // "AuthenticAMD"
+    {
+        unsigned int max_ext = __get_cpuid_max(0x80000000, NULL);
+        // PerfMonV2 reports the number of core counters, older parts have 6 with the
+        // core counter extension and 4 without, and no fixed counters
+        if (max_ext >= 0x80000022)
+        {
+            __cpuid(0x80000022, eax, ebx, ecx, edx);
+            if (eax & 1) { general = ebx & 0xf; return; }
+        }
+        if (max_ext >= 0x80000001)
+        {
+            __cpuid(0x80000001, eax, ebx, ecx, edx);
+            general = (ecx & (1u << 23)) ? 6 : 4;
+        }
+    }
+    else if (max_leaf >= 0xA)
+    {
+        // Architectural performance monitoring leaf, version 0 means there is none (e.g. in a VM)
+        __cpuid(0xA, eax, ebx, ecx, edx);
+        unsigned int version = eax & 0xff;
+        if (version > 0) general = (eax >> 8) & 0xff;
+        if (version > 1) fixed = edx & 0x1f;
+    }
+#endif
+}
+
 class gBenchPerf_handler
 {
 public:
     gBenchPerf_handler(unsigned int type=PERF_TYPE_HARDWARE,
                        unsigned long long config=PERF_COUNT_HW_CPU_CYCLES,
                        int group_fd=-1)
-    :_perf(-1),_type(type),_config(config),_group_fd(group_fd),_perf_cnt(0),_multiplexing(false){}
+    :_perf(-1),_type(type),_config(config),_group_fd(group_fd),_grouped(false),_user_read(false),_page(NULL),_owner(0),_perf_cnt(0),_multiplexing(false)
+    {
+        memset(&_base, 0, sizeof(_base));
+    }
 
-    ~gBenchPerf_handler() { if (_perf != -1) close(_perf); }
+    ~gBenchPerf_handler()
+    {
+        if (_page) munmap(_page, sysconf(_SC_PAGESIZE));
+        if (_perf != -1) ::close(_perf);
+    }
 
     gBenchPerf_handler(const gBenchPerf_handler& rhs)
     {
@@ -92,22 +173,32 @@ public:
         _type = rhs._type;
         _config = rhs._config;
         _group_fd = rhs._group_fd;
+        _grouped = rhs._grouped;
+        _user_read = rhs._user_read;
+        _page = rhs._page;
+        _owner = rhs._owner;
         _perf_cnt = rhs._perf_cnt;
         _multiplexing = rhs._multiplexing;
+        _base = rhs._base;
     }
     void set_type(unsigned int type) { _type = type; }
     void set_config(unsigned long long config) { _config = config; }
+    // Open as part of a group, led by the event open on group_fd (or leading it, if -1)
+    // A grouped event is started, stopped and read through its leader, see gBenchPerf_event
+    void set_group(int group_fd) { _group_fd = group_fd; _grouped = true; }
+    // Read the counter with rdpmc, through the event's mmap page, when the thread that
+    // opened the event reads it (see read_user). Takes effect the next time the event is opened.
+    void set_user_read(bool user_read) { _user_read = user_read; }
 
 //        exclude_user   : 1,   /* don't count user */
 //        exclude_kernel : 1,   /* don't count kernel */
 //        exclude_hv     : 1,   /* don't count hypervisor */
 //        exclude_idle   : 1,   /* don't count when idle */
+    // pid is the kernel ID of the thread to count, or 0 for the calling thread
     int open(bool exclude_user, bool exclude_kernel,
-              bool exclude_idle, bool exclude_hv=false)
+              bool exclude_idle, bool exclude_hv=false, pid_t pid=0)
     {
-        if (_perf != -1) close(_perf);
-        _perf_cnt = 0;
-        _multiplexing = false;
+        close();
 
         struct perf_event_attr _perf_attr;
         memset(&_perf_attr, 0, sizeof(struct perf_event_attr));
@@ -117,23 +208,55 @@ public:
         _perf_attr.disabled = 1;
         _perf_attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
                 PERF_FORMAT_TOTAL_TIME_RUNNING | PERF_FORMAT_ID;
+        if (_grouped) _perf_attr.read_format |= PERF_FORMAT_GROUP;
 
         if (exclude_user)   _perf_attr.exclude_user = 1;
         if (exclude_kernel) _perf_attr.exclude_kernel = 1;
         if (exclude_idle)   _perf_attr.exclude_idle = 1;
         if (exclude_hv)     _perf_attr.exclude_hv = 1;
 
-        _perf = perf_event_open(&_perf_attr, 0, -1, _group_fd, 0);
+        _perf = perf_event_open(&_perf_attr, pid, -1, _group_fd, 0);
+        _owner = pid != 0 ? pid : perf_current_tid();
+#if defined(PERF_HAVE_RDPMC)
+        if (_perf != -1 && _user_read)
+        {
+            void* page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, _perf, 0);
+            _page = page == MAP_FAILED ? NULL : (struct perf_event_mmap_page*)page;
+        }
+#endif
         return _perf;
     }
 
+    void close(void)
+    {
+        if (_page) munmap(_page, sysconf(_SC_PAGESIZE));
+        _page = NULL;
+        if (_perf != -1) ::close(_perf);
+        _perf = -1;
+        _perf_cnt = 0;
+        _multiplexing = false;
+        memset(&_base, 0, sizeof(_base));
+    }
+
+    bool is_open(void) const { return _perf != -1; }
+    unsigned int type(void) const { return _type; }
+    unsigned long long config(void) const { return _config; }
+    // Software and tracepoint events are counted by the kernel, others take a PMU counter
+    bool uses_counter(void) const { return _type != PERF_TYPE_SOFTWARE && _type != PERF_TYPE_TRACEPOINT; }
+    // Kernel ID of the thread the event counts
+    pid_t owner(void) const { return _owner; }
+    int fd(void) const { return _perf; }
+
+    // The event may stay open across any number of start/stop pairs, counts are
+    // taken relative to the value and times read when it was last started
     void start(void)
     {
         if (_perf == -1) return;
         _multiplexing = false;
         _perf_cnt = 0;
 
-        ioctl(_perf, PERF_EVENT_IOC_RESET, 0);
+        if (::read(_perf, &_base, sizeof(struct read_format)) < 0)
+            memset(&_base, 0, sizeof(_base));
         ioctl(_perf, PERF_EVENT_IOC_ENABLE, 0);
     }
 
@@ -143,7 +266,7 @@ public:
 
         struct read_format ret;
         ioctl(_perf, PERF_EVENT_IOC_DISABLE, 0);
-        long int n = read(_perf, &ret, sizeof(struct read_format));
+        long int n = ::read(_perf, &ret, sizeof(struct read_format));
 
         if (n < 0)
         {
@@ -151,18 +274,139 @@ public:
             return 0;
         }
 
-        if (ret.time_enabled != ret.time_running) _multiplexing = true;
-        if (_multiplexing)
-            _perf_cnt = ret.value * ((double)ret.time_enabled / (double)ret.time_running);
-        else
-            _perf_cnt = ret.value;
+        _perf_cnt = count_since_start(ret, _multiplexing);
         return _perf_cnt;
     }
 
+    // Read the current count without disabling the event
+    unsigned long long read(void)
+    {
+        if (_perf == -1) return 0;
+
+        struct read_format ret;
+        if (read_user(ret))
+        {
+            _perf_cnt = count_since_start(ret, _multiplexing);
+            return _perf_cnt;
+        }
+        long int n = ::read(_perf, &ret, sizeof(struct read_format));
+
+        if (n < 0)
+        {
+            std::cout<<"error when reading perf"<<std::endl;
+            return 0;
+        }
+
+        _perf_cnt = count_since_start(ret, _multiplexing);
+        return _perf_cnt;
+    }
+
+    // Read the current count without disabling the event or updating the saved count
+    // Safe to call from another thread while the event is open
+    unsigned long long peek(void) const
+    {
+        if (_perf == -1) return 0;
+
+        struct read_format ret;
+        if (::read(_perf, &ret, sizeof(struct read_format)) < 0) return 0;
+        bool multiplexing = false;
+        return count_since_start(ret, multiplexing);
+    }
+
+    // Equivalents of start, stop/read and peek for an event in a group, given the
+    // values read through the group leader
+    void start_from(const struct read_format& base)
+    {
+        _multiplexing = false;
+        _perf_cnt = 0;
+        _base = base;
+    }
+    unsigned long long update_from(const struct read_format& ret)
+    {
+        _perf_cnt = count_since_start(ret, _multiplexing);
+        return _perf_cnt;
+    }
+    unsigned long long peek_from(const struct read_format& ret) const
+    {
+        bool multiplexing = false;
+        return count_since_start(ret, multiplexing);
+    }
+
+    // Read the event without a system call, following the protocol documented for
+    // struct perf_event_mmap_page in linux/perf_event.h
+    // Only possible on the thread that opened the event, and only if the kernel allows
+    // rdpmc for it (cap_user_rdpmc), returns false if the caller has to use read(2)
+    bool read_user(struct read_format& ret) const
+    {
+#if defined(PERF_HAVE_RDPMC)
+        if (!_page || perf_current_tid() != _owner) return false;
+        volatile struct perf_event_mmap_page* pc = _page;
+        unsigned int seq, idx;
+        unsigned long long enabled, running, cyc = 0;
+        unsigned long long time_offset = 0, time_mult = 0, time_shift = 0;
+        long long count;
+        do
+        {
+            seq = pc->lock;
+            __asm__ __volatile__("" ::: "memory");
+            if (!pc->cap_user_rdpmc) return false;
+            enabled = pc->time_enabled;
+            running = pc->time_running;
+            if (pc->cap_user_time && enabled != running)
+            {
+                cyc = perf_rdtsc();
+                time_offset = pc->time_offset;
+                time_mult = pc->time_mult;
+                time_shift = pc->time_shift;
+            }
+            idx = pc->index;
+            count = pc->offset;
+            if (idx)
+            {
+                unsigned int width = pc->pmc_width;
+                // Counters are only pmc_width bits wide, sign extend them
+                long long pmc = (long long)(perf_rdpmc(idx - 1) << (64 - width)) >> (64 - width);
+                count += pmc;
+            }
+            __asm__ __volatile__("" ::: "memory");
+        } while (pc->lock != seq);
+
+        // The times are only updated when the event is scheduled, extrapolate them to now
+        if (time_mult != 0)
+        {
+            unsigned long long quot = cyc >> time_shift;
+            unsigned long long rem = cyc & (((unsigned long long)1 << time_shift) - 1);
+            unsigned long long delta = time_offset + quot * time_mult + ((rem * time_mult) >> time_shift);
+            enabled += delta;
+            if (idx) running += delta;
+        }
+        ret.value = count;
+        ret.time_enabled = enabled;
+        ret.time_running = running;
+        ret.id = 0;
+        return true;
+#else
+        (void)ret;
+        return false;
+#endif
+    }
+
     unsigned long long get_perf_cnt(void) { return _perf_cnt; }
     bool is_multiplexing(void) { return _multiplexing; }
 
 protected:
+    // Count since the event was started, scaled up if it was multiplexed in the meantime
+    unsigned long long count_since_start(const struct read_format& ret, bool& multiplexing) const
+    {
+        unsigned long long value = ret.value - _base.value;
+        unsigned long long enabled = ret.time_enabled - _base.time_enabled;
+        unsigned long long running = ret.time_running - _base.time_running;
+        if (enabled != running) multiplexing = true;
+        if (multiplexing && running != 0)
+            return value * ((double)enabled / (double)running);
+        return value;
+    }
+
     long perf_event_open( struct perf_event_attr *hw_event, pid_t pid,
                       int cpu, int group_fd, unsigned long flags )
     {
@@ -178,9 +422,16 @@ protected:
     unsigned int _type;
     unsigned long long _config;
     int _group_fd;
+    bool _grouped;
+    bool _user_read;
+    // Mapped first page of the event, if it may be read with rdpmc
+    struct perf_event_mmap_page* _page;
+    // Thread that opened the event, the only one that can read it with rdpmc
+    pid_t _owner;
 
     unsigned long long _perf_cnt;
     bool _multiplexing;
+    struct read_format _base;
 };
 
 #define GBENCH_PERF_INIT(id) gBenchPerf_full perf_##id; perf_##id.open();
@@ -216,6 +467,8 @@ public:
         _event_vec = rhs._event_vec;
         _cnt_vec = rhs._cnt_vec;
         _multiplexing_vec = rhs._multiplexing_vec;
+        _leader_vec = rhs._leader_vec;
+        _group_vec = rhs._group_vec;
         exclude_user = rhs.exclude_user;
         exclude_kernel = rhs.exclude_kernel;
         exclude_idle = rhs.exclude_idle;
@@ -309,6 +562,8 @@ public:
         _event_vec = rhs._event_vec;
         _cnt_vec = rhs._cnt_vec;
         _multiplexing_vec = rhs._multiplexing_vec;
+        _leader_vec = rhs._leader_vec;
+        _group_vec = rhs._group_vec;
         exclude_user = rhs.exclude_user;
         exclude_kernel = rhs.exclude_kernel;
         exclude_idle = rhs.exclude_idle;
@@ -322,6 +577,12 @@ public:
         event_parser(arg);
     }
 
+    // Read events with rdpmc where possible, see gBenchPerf_handler::read_user
+    void set_user_read(bool user_read)
+    {
+        for (size_t i=0;i<_perf_vec.size();i++) _perf_vec[i].set_user_read(user_read);
+    }
+
     void open(bool exclude_user, bool exclude_kernel,
               bool exclude_idle, bool exclude_hv=false)
     {
@@ -334,46 +595,123 @@ public:
             }
         }
     }
-    void open(int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ)
+    // Events stay open from one call to the next while the same group_id is asked for
+    // Events of any other group are closed, so only one group holds file descriptors at a time
+    // The events of a group_id are opened as one perf event group, led by its first event,
+    // so they are always scheduled together and are read with a single read(2)
+    // Events count the thread with kernel ID pid (0 for the calling thread), if that
+    // changes the events are opened again
+    // Returns false if another thread's events could not be opened because it has exited (ESRCH)
+    // The range is then left closed with zero counts, instead of exiting. Any other error exits.
+    bool open(int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ, pid_t pid=0)
     {
-        size_t start = (group_id == -1)? 0 : group_id*group_size;
-        size_t end = (group_id == -1)? _perf_vec.size() : start+group_size;
-        if (start >= _perf_vec.size()) return;
-        if (end > _perf_vec.size()) end = _perf_vec.size();
+        size_t start, end;
+        group_range(group_id, group_size, start, end);
+        if (start >= end) return true;
+        _leader_vec.resize(_perf_vec.size(), -1);
+        for (size_t i=0;i<_perf_vec.size();i++)
+        {
+            if ((i < start || i >= end) && _perf_vec[i].is_open())
+            {
+                _perf_vec[i].close();
+                _leader_vec[i] = -1;
+            }
+        }
 
+        pid_t owner = pid != 0 ? pid : perf_current_tid();
+        bool reopen = false;
         for (size_t i=start;i<end;i++)
         {
-            if (-1 == _perf_vec[i].open(exclude_user,exclude_kernel,exclude_idle,exclude_hv))
+            if (!_perf_vec[i].is_open() || _perf_vec[i].owner() != owner) reopen = true;
+        }
+        if (!reopen) return true;
+
+        for (size_t i=start;i<end;i++)
+        {
+            if (group_id != -1)
             {
-                std::cout<<"cannot open perf event: "<< _event_vec[i] << "\n";
+                _perf_vec[i].set_group(i == start ? -1 : _perf_vec[start].fd());
+                _leader_vec[i] = start;
+            }
+            if (-1 == _perf_vec[i].open(exclude_user,exclude_kernel,exclude_idle,exclude_hv,pid))
+            {
+                int error = errno;
+                if (error == ESRCH && owner != perf_current_tid())
+                {
+                    for (size_t j=start;j<end;j++)
+                    {
+                        _perf_vec[j].close();
+                        _leader_vec[j] = -1;
+                        _cnt_vec[j] = 0;
+                        _multiplexing_vec[j] = false;
+                    }
+                    return false;
+                }
+                std::cout<<"cannot open perf event: "<< _event_vec[i] << " for thread " << owner
+                         << ": " << strerror(error) << "\n";
                 exit(50);
             }
         }
+        return true;
     }
 
     void start(int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ)
     {
-        size_t start = (group_id == -1)? 0 : group_id*group_size;
-        size_t end = (group_id == -1)? _perf_vec.size() : start+group_size;
-        if (start >= _perf_vec.size()) return;
-        if (end > _perf_vec.size()) end = _perf_vec.size();
+        size_t start, end;
+        group_range(group_id, group_size, start, end);
+        if (start >= end) return;
 
         for (size_t i=start;i<end;i++)
         {
-            _perf_vec[i].start();
+            if (is_leader(i))
+            {
+                // Take the baseline of the whole group, then enable it at once
+                std::vector<struct read_format> values;
+                size_t n = read_group(i, values);
+                for (size_t j=0;j<n;j++) _perf_vec[i+j].start_from(values[j]);
+                ioctl(_perf_vec[i].fd(), PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+                i += group_size_of(i) - 1;
+            }
+            else
+                _perf_vec[i].start();
         }
     }
 
     void stop(int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ)
     {
-        size_t start = (group_id == -1)? 0 : group_id*group_size;
-        size_t end = (group_id == -1)? _perf_vec.size() : start+group_size;
-        if (start >= _perf_vec.size()) return;
-        if (end > _perf_vec.size()) end = _perf_vec.size();
+        size_t start, end;
+        group_range(group_id, group_size, start, end);
+        if (start >= end) return;
 
         for (size_t i=start;i<end;i++)
         {
-            _perf_vec[i].stop();
+            if (is_leader(i))
+            {
+                ioctl(_perf_vec[i].fd(), PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+                i += update_group(i) - 1;
+            }
+            else
+                _perf_vec[i].stop();
+        }
+        for (size_t i=start;i<end;i++)
+        {
+            _cnt_vec[i] = _perf_vec[i].get_perf_cnt();
+            _multiplexing_vec[i] = _perf_vec[i].is_multiplexing();
+        }
+    }
+
+    void read(int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ)
+    {
+        size_t start, end;
+        group_range(group_id, group_size, start, end);
+        if (start >= end) return;
+
+        for (size_t i=start;i<end;i++)
+        {
+            if (is_leader(i))
+                i += update_group(i) - 1;
+            else
+                _perf_vec[i].read();
         }
         for (size_t i=start;i<end;i++)
         {
@@ -384,10 +722,9 @@ public:
 
     std::string toString(int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ)
     {
-        size_t start = (group_id == -1)? 0 : group_id*group_size;
-        size_t end = (group_id == -1)? _perf_vec.size() : start+group_size;
-        if (start >= _perf_vec.size()) return "{}";
-        if (end > _perf_vec.size()) end = _perf_vec.size();
+        size_t start, end;
+        group_range(group_id, group_size, start, end);
+        if (start >= end) return "{}";
         std::ostringstream oss;
         oss << "{\n";
         for (size_t i=start;i<end;i++)
@@ -410,6 +747,19 @@ public:
 
         return _cnt_vec[id];
     }
+    // Current count of an event, read directly from the kernel
+    unsigned long long peek(size_t id) const
+    {
+        if (id >= _perf_vec.size()) return 0;
+        if (id < _leader_vec.size() && _leader_vec[id] != -1)
+        {
+            size_t leader = _leader_vec[id];
+            std::vector<struct read_format> values;
+            if (read_group(leader, values) <= id - leader) return 0;
+            return _perf_vec[id].peek_from(values[id - leader]);
+        }
+        return _perf_vec[id].peek();
+    }
     std::string event_name(size_t id)
     {
         if (id >= _cnt_vec.size())
@@ -428,7 +778,159 @@ public:
     {
         return _cnt_vec.size();
     }
+
+    // Events [start, end) of group group_id, or of every event if group_id is -1
+    // Once pack_groups has run these are the packed groups, otherwise consecutive
+    // slices of group_size events (a group_size of 0 puts every event in one group)
+    void group_range(int group_id, unsigned group_size, size_t& start, size_t& end) const
+    {
+        size_t n = _perf_vec.size();
+        if (group_id == -1) { start = 0; end = n; return; }
+        if (!_group_vec.empty())
+        {
+            bool valid = (size_t)group_id + 1 < _group_vec.size();
+            start = valid ? _group_vec[group_id] : n;
+            end = valid ? _group_vec[group_id + 1] : n;
+            return;
+        }
+        if (group_size == 0) group_size = n;
+        start = std::min<size_t>((size_t)group_id * group_size, n);
+        end = std::min<size_t>(start + group_size, n);
+    }
+    // Number of groups, see group_range
+    size_t get_group_cnt(unsigned group_size) const
+    {
+        if (!_group_vec.empty()) return _group_vec.size() - 1;
+        if (group_size == 0) return 1;
+        return (_perf_vec.size() + group_size - 1) / group_size;
+    }
+
+    // Rearrange the events into as few groups as possible, each of which can be counted
+    // without multiplexing. Each event joins the first group it still fits in, which is
+    // checked by opening the group on the calling thread (see can_schedule). Groups never
+    // hold more hardware events than the PMU has counters, if that number is known.
+    // Must be called before the events are opened.
+    void pack_groups(void)
+    {
+        if (_perf_vec.size() != _event_vec.size()) return;
+        unsigned int general, fixed;
+        perf_pmu_counters(general, fixed);
+        size_t max_counters = general + fixed;
+
+        std::vector<std::vector<size_t> > groups;
+        std::vector<size_t> counters;
+        for (size_t i=0;i<_perf_vec.size();i++)
+        {
+            bool hw = _perf_vec[i].uses_counter();
+            size_t g;
+            for (g=0;g<groups.size();g++)
+            {
+                if (hw && max_counters != 0 && counters[g] >= max_counters) continue;
+                groups[g].push_back(i);
+                if (can_schedule(groups[g])) break;
+                groups[g].pop_back();
+            }
+            if (g == groups.size())
+            {
+                groups.push_back(std::vector<size_t>(1, i));
+                counters.push_back(0);
+            }
+            if (hw) counters[g]++;
+        }
+
+        // Store the events of each group next to each other
+        std::vector<gBenchPerf_handler> perf_vec;
+        std::vector<std::string> event_vec;
+        _group_vec.assign(1, 0);
+        for (size_t g=0;g<groups.size();g++)
+        {
+            for (size_t j=0;j<groups[g].size();j++)
+            {
+                perf_vec.push_back(_perf_vec[groups[g][j]]);
+                event_vec.push_back(_event_vec[groups[g][j]]);
+            }
+            _group_vec.push_back(perf_vec.size());
+        }
+        _perf_vec.swap(perf_vec);
+        _event_vec.swap(event_vec);
+        _leader_vec.clear();
+    }
 protected:
+    // Whether the events can be counted together as one group without multiplexing:
+    // the group is opened and enabled for a moment on the calling thread, and has to
+    // be running for all of the time it was enabled
+    bool can_schedule(const std::vector<size_t>& ids) const
+    {
+        std::vector<gBenchPerf_handler> group;
+        // Handlers share their fd when copied, so the vector must never reallocate
+        group.reserve(ids.size());
+        for (size_t j=0;j<ids.size();j++)
+        {
+            group.push_back(gBenchPerf_handler(_perf_vec[ids[j]].type(), _perf_vec[ids[j]].config()));
+            group[j].set_group(j == 0 ? -1 : group[0].fd());
+            if (-1 == group[j].open(exclude_user,exclude_kernel,exclude_idle,exclude_hv)) return false;
+        }
+
+        int leader = group[0].fd();
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        for (volatile int spin = 0; spin < 100000; spin++) {}
+        ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+        std::vector<unsigned long long> buf(PERF_GROUP_READ_WORDS(ids.size()));
+        if (::read(leader, buf.data(), buf.size() * sizeof(buf[0])) < 0) return false;
+        return buf[2] > 0 && buf[1] == buf[2];
+    }
+
+    bool is_leader(size_t i) const
+    {
+        return i < _leader_vec.size() && _leader_vec[i] == (int)i;
+    }
+
+    // Number of events in the group led by event i
+    size_t group_size_of(size_t i) const
+    {
+        size_t n = 1;
+        while (i + n < _leader_vec.size() && _leader_vec[i + n] == (int)i) n++;
+        return n;
+    }
+
+    // Read every event in the group led by event i, returns the number of events read
+    size_t read_group(size_t i, std::vector<struct read_format>& values) const
+    {
+        size_t n = group_size_of(i);
+        // Use rdpmc if every event in the group allows it, which saves the system call
+        values.resize(n);
+        size_t n_user = 0;
+        while (n_user < n && _perf_vec[i+n_user].read_user(values[n_user])) n_user++;
+        if (n_user == n) return n;
+
+        std::vector<unsigned long long> buf(PERF_GROUP_READ_WORDS(n));
+        if (::read(_perf_vec[i].fd(), buf.data(), buf.size() * sizeof(buf[0])) < 0)
+        {
+            std::cout<<"error when reading perf group"<<std::endl;
+            return 0;
+        }
+        size_t nr = std::min<size_t>(buf[0], n);
+        values.resize(nr);
+        for (size_t j=0;j<nr;j++)
+        {
+            values[j].value = buf[PERF_GROUP_READ_HEADER + 2*j];
+            values[j].time_enabled = buf[1];
+            values[j].time_running = buf[2];
+            values[j].id = buf[PERF_GROUP_READ_HEADER + 2*j + 1];
+        }
+        return nr;
+    }
+
+    // Update the counts of every event in the group led by event i, returns the size of the group
+    size_t update_group(size_t i)
+    {
+        std::vector<struct read_format> values;
+        size_t n = read_group(i, values);
+        for (size_t j=0;j<n;j++) _perf_vec[i+j].update_from(values[j]);
+        return group_size_of(i);
+    }
+
     //parsing event list arguments
     void event_parser(std::string arguments)
     {
@@ -673,6 +1175,10 @@ protected:
     std::vector<std::string> _event_vec;
     std::vector<unsigned long long> _cnt_vec;
     std::vector<bool> _multiplexing_vec;
+    // Index of the leader of each event's group, or -1 if the event is not in a group
+    std::vector<int> _leader_vec;
+    // First event of each group and one past the last event, set by pack_groups
+    std::vector<size_t> _group_vec;
     bool exclude_user;
     bool exclude_kernel;
     bool exclude_idle;
@@ -683,14 +1189,27 @@ class gBenchPerf_multi
 {
 public:
     gBenchPerf_multi(unsigned threadnum, const gBenchPerf_event& rhs)
+    : _proto(rhs)
     {
         _perf_vec.resize(threadnum, rhs);
     }
 
-    void open(unsigned tid, int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ)
+    // Add threads, with events that are not open yet
+    void resize(unsigned threadnum)
     {
-        if (tid >= _perf_vec.size()) return;
-        _perf_vec[tid].open(group_id, group_size);
+        while (_perf_vec.size() < threadnum) _perf_vec.push_back(_proto);
+    }
+
+    void set_user_read(bool user_read)
+    {
+        _proto.set_user_read(user_read);
+        for (size_t i=0;i<_perf_vec.size();i++) _perf_vec[i].set_user_read(user_read);
+    }
+    // Open the events of thread tid, which has kernel ID pid (0 if it is the calling thread)
+    bool open(unsigned tid, int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ, pid_t pid=0)
+    {
+        if (tid >= _perf_vec.size()) return false;
+        return _perf_vec[tid].open(group_id, group_size, pid);
     }
     void start(unsigned tid, int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ)
     {
@@ -702,12 +1221,39 @@ public:
         if (tid >= _perf_vec.size()) return;
         _perf_vec[tid].stop(group_id, group_size);
     }
+    void read(unsigned tid, int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ)
+    {
+        if (tid >= _perf_vec.size()) return;
+        _perf_vec[tid].read(group_id, group_size);
+    }
+    unsigned long long event_counter(unsigned tid, size_t id)
+    {
+        if (tid >= _perf_vec.size()) return 0;
+        return _perf_vec[tid].event_counter(id);
+    }
+    unsigned long long peek(unsigned tid, size_t id) const
+    {
+        if (tid >= _perf_vec.size()) return 0;
+        return _perf_vec[tid].peek(id);
+    }
+    bool event_mux(unsigned tid, size_t id)
+    {
+        if (tid >= _perf_vec.size()) return false;
+        return _perf_vec[tid].event_mux(id);
+    }
+    std::string event_name(size_t id) { return _perf_vec[0].event_name(id); }
+    size_t get_event_cnt(void) { return _perf_vec[0].get_event_cnt(); }
+    size_t get_thread_cnt(void) { return _perf_vec.size(); }
+    void group_range(int group_id, unsigned group_size, size_t& start, size_t& end) const
+    {
+        _perf_vec[0].group_range(group_id, group_size, start, end);
+    }
+    size_t get_group_cnt(unsigned group_size) const { return _perf_vec[0].get_group_cnt(group_size); }
     std::string toString(int group_id=-1, unsigned group_size=DEFAULT_PERF_GRP_SZ)
     {
-        size_t start = (group_id == -1)? 0 : group_id*group_size;
-        size_t end = (group_id == -1)? _perf_vec[0].get_event_cnt() : start+group_size;
-        if (start >= _perf_vec[0].get_event_cnt()) return "{}";
-        if (end > _perf_vec[0].get_event_cnt()) end = _perf_vec[0].get_event_cnt();
+        size_t start, end;
+        group_range(group_id, group_size, start, end);
+        if (start >= end) return "{}";
         bool mux=false;
         std::ostringstream oss;
         oss << "{\n";
@@ -729,7 +1275,10 @@ public:
         return oss.str();
     }
 protected:
-    std::vector<gBenchPerf_event> _perf_vec;
+    // Events of each thread, copied from _proto before they are opened
+    // A deque, since copies of an open event share its fds and must never be made by a reallocation
+    std::deque<gBenchPerf_event> _perf_vec;
+    gBenchPerf_event _proto;
 };
 
 #endif
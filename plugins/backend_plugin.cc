@@ -0,0 +1,12 @@
+// Builds one of the backends in hooks_backends.h as a plugin that can be loaded with HOOKS_BACKEND
+//
+// Compile with the backend enabled, and the plugin's name and backend class, e.g.:
+//
+//     -DENABLE_PERF_HOOKS -DHOOKS_PLUGIN_NAME=perf -DHOOKS_PLUGIN_BACKEND=perf_backend
+
+#include "hooks_backends.h"
+
+#define HOOKS_STRINGIFY_(x) #x
+#define HOOKS_STRINGIFY(x) HOOKS_STRINGIFY_(x)
+
+HOOKS_DEFINE_PLUGIN(HOOKS_STRINGIFY(HOOKS_PLUGIN_NAME), HOOKS_PLUGIN_BACKEND)
@@ -0,0 +1,46 @@
+// Converts a file of MessagePack records (written with HOOKS_FORMAT=msgpack) back to json, one record per line
+//
+// Usage: hooks_convert [input] [output]
+// Reads from stdin and writes to stdout if files are not specified
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include "json.hpp"
+#include "hooks_msgpack.h"
+
+using json = nlohmann::json;
+
+int main(int argc, char* argv[])
+{
+    std::ifstream in_file;
+    std::ofstream out_file;
+    if (argc > 1) {
+        in_file.open(argv[1], std::ifstream::binary);
+        if (!in_file) {
+            std::cerr << "ERROR: cannot open " << argv[1] << "\n";
+            return 1;
+        }
+    }
+    if (argc > 2) {
+        out_file.open(argv[2]);
+        if (!out_file) {
+            std::cerr << "ERROR: cannot open " << argv[2] << "\n";
+            return 1;
+        }
+    }
+    std::istream& in = argc > 1 ? in_file : std::cin;
+    std::ostream& out = argc > 2 ? out_file : std::cout;
+
+    json record;
+    long num_records = 0;
+    while (in.peek() != EOF) {
+        if (!hooks_msgpack::unpack(in, record)) {
+            std::cerr << "ERROR: malformed record after " << num_records << " records\n";
+            return 1;
+        }
+        out << record << "\n";
+        num_records += 1;
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+// Recovers the committed records from a ring file (written with HOOKS_RING_SIZE) and prints them as json, one per line
+//
+// Usage: hooks_ring_reader ring_file [output]
+//
+// Works on the file left behind by a process that was killed: records that were not
+// committed, or were partially overwritten when the ring wrapped, are skipped.
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "json.hpp"
+#include "hooks_msgpack.h"
+#include "hooks_ring.h"
+#include "hooks_writer.h"
+
+using json = nlohmann::json;
+
+struct found_record
+{
+    uint64_t seq;
+    const char* payload;
+    uint32_t length;
+    bool operator<(const found_record& other) const { return seq < other.seq; }
+};
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " ring_file [output]\n";
+        return 1;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || (size_t)st.st_size < hooks_ring::header_size) {
+        std::cerr << "ERROR: cannot open ring file " << argv[1] << "\n";
+        return 1;
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        std::cerr << "ERROR: cannot map ring file " << argv[1] << "\n";
+        return 1;
+    }
+    const ring_file_header* header = static_cast<const ring_file_header*>(map);
+    if (memcmp(header->magic, hooks_ring::file_magic(), sizeof(header->magic)) != 0
+     || header->version != hooks_ring::file_version
+     || hooks_ring::header_size + header->capacity > (uint64_t)st.st_size) {
+        std::cerr << "ERROR: " << argv[1] << " is not a ring file\n";
+        return 1;
+    }
+    const char* data = static_cast<const char*>(map) + hooks_ring::header_size;
+    uint64_t capacity = header->capacity;
+    uint64_t committed_seq = header->committed_seq;
+
+    // Scan the whole data area for intact records, the oldest ones may have been partially overwritten
+    std::vector<found_record> records;
+    uint64_t offset = 0;
+    while (offset + sizeof(ring_record) <= capacity) {
+        const ring_record* r = reinterpret_cast<const ring_record*>(data + offset);
+        const char* payload = data + offset + sizeof(ring_record);
+        if (r->magic == hooks_ring::record_magic
+         && r->seq > 0 && r->seq <= committed_seq
+         && offset + hooks_ring::padded_size(r->length) <= capacity
+         && hooks_ring::checksum(payload, r->length) == r->checksum) {
+            records.push_back({r->seq, payload, r->length});
+            offset += hooks_ring::padded_size(r->length);
+        } else {
+            offset += 8;
+        }
+    }
+    std::sort(records.begin(), records.end());
+
+    // Keep the most recent run of consecutive records that ends with the last commit
+    size_t first = records.size();
+    while (first > 0 && records[first - 1].seq + (records.size() - first) == committed_seq) {
+        first -= 1;
+    }
+
+    std::ofstream out_file;
+    if (argc > 2) { out_file.open(argv[2]); }
+    std::ostream& out = argc > 2 ? out_file : std::cout;
+    for (size_t i = first; i < records.size(); ++i) {
+        if (header->format == hooks_writer::MSGPACK) {
+            std::istringstream in(std::string(records[i].payload, records[i].length));
+            json record;
+            if (!hooks_msgpack::unpack(in, record)) {
+                std::cerr << "ERROR: malformed record " << records[i].seq << "\n";
+                return 1;
+            }
+            out << record << "\n";
+        } else {
+            out.write(records[i].payload, records[i].length);
+            out << "\n";
+        }
+    }
+    std::cerr << "Recovered " << records.size() - first << " of " << committed_seq << " records\n";
+    return 0;
+}